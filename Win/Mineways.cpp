@@ -41,8 +41,8 @@ THE POSSIBILITY OF SUCH DAMAGE.
 // zoomed all the way in. We could allow this to be larger...
 // It's useful to have it high for Nether <--> overworld switches
 #define MAXZOOM 40.0
-// zoomed all the way out
-#define MINZOOM 1.0
+// zoomed all the way out; below 1 the map goes in halves, see zoomMap()
+#define MINZOOM 0.0625
 
 // how far outside the rectangle we'll select the corners and edges of the selection rectangle
 #define SELECT_MARGIN 5
@@ -76,7 +76,7 @@ static BOOL gLoaded=FALSE;								//world loaded?
 static double gCurX,gCurZ;								//current X and Z
 static int gLockMouseX=0;                               // if true, don't allow this coordinate to change with mouse, 
 static int gLockMouseZ=0;
-static double gCurScale=MINZOOM;					    //current scale
+static double gCurScale=1.0;					        //current scale
 static int gCurDepth=MAP_MAX_HEIGHT;					//current depth
 static int gStartHiX,gStartHiZ;						    //starting highlight X and Z
 
@@ -154,6 +154,11 @@ static struct {
 // Number of lines to read from the header - don't want to go too far
 #define HEADER_LINES 60
 
+// While panning or zooming, the map is drawn with what's already read in and then
+// filled in from a timer, this many chunks at a time, so the window stays responsive.
+#define DRAW_TIMER 1
+#define DRAW_STEP_CHUNKS 64
+
 // Forward declarations of functions included in this code module:
 ATOM				MyRegisterClass(HINSTANCE hInstance);
 BOOL				InitInstance(HINSTANCE, int);
@@ -166,6 +171,10 @@ static void enableBottomControl( int state, HWND hwndBottomSlider, HWND hwndBott
 static void validateItems(HMENU menu);
 static int loadWorldList(HMENU menu);
 static void draw();
+static double zoomMap(double scale, int zoomIn, double step);
+static void drawInBackground(HWND hWnd);
+static void swapRedBlue(int left, int top, int right, int bottom);
+static void swapDrawnAreas();
 static void gotoSurface( HWND hWnd, HWND hwndSlider, HWND hwndLabel);
 static void updateStatus(int mx, int mz, int my, const char *blockLabel, HWND hwndStatus);
 static void populateColorSchemes(HMENU menu);
@@ -608,9 +617,8 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         {
             int zDelta=GET_WHEEL_DELTA_WPARAM(wParam);
             // ratchet zoom up by 2x when zoom of 8 or higher is reached, so it zooms faster
-            gCurScale+=((double)zDelta/WHEEL_DELTA)*(pow(gCurScale,1.2)/gCurScale);
-            gCurScale = clamp(gCurScale,MINZOOM,MAXZOOM);
-            draw();
+            gCurScale=zoomMap(gCurScale,zDelta>0,(abs(zDelta)/(double)WHEEL_DELTA)*(pow(gCurScale,1.2)/gCurScale));
+            drawInBackground(hWnd);
             InvalidateRect(hWnd,NULL,FALSE);
             UpdateWindow(hWnd);
         }
@@ -815,7 +823,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
                 gCurX-=(mouseX-oldX)/gCurScale;
                 oldX=mouseX;
                 oldY=mouseY;
-                draw();
+                drawInBackground(hWnd);
                 InvalidateRect(hWnd,NULL,FALSE);
                 UpdateWindow(hWnd);
             }
@@ -883,16 +891,12 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
                     break;
                 case VK_PRIOR:
                 case 'E':
-                    gCurScale+=0.5; // 0.25*pow(gCurScale,1.2)/gCurScale;
-                    if (gCurScale>MAXZOOM)
-                        gCurScale=MAXZOOM;
+                    gCurScale=zoomMap(gCurScale,1,0.5); // 0.25*pow(gCurScale,1.2)/gCurScale;
                     changed=TRUE;
                     break;
                 case VK_NEXT:
                 case 'Q':
-                    gCurScale-=0.5; // 0.25*pow(gCurScale,1.2)/gCurScale;
-                    if (gCurScale<MINZOOM)
-                        gCurScale=MINZOOM;
+                    gCurScale=zoomMap(gCurScale,0,0.5); // 0.25*pow(gCurScale,1.2)/gCurScale;
                     changed=TRUE;
                     break;
                 // bottom: set depth to save down to (or up to)
@@ -1029,7 +1033,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
                 }
                 if (changed)
                 {
-                    draw();
+                    drawInBackground(hWnd);
                     InvalidateRect(hWnd,NULL,FALSE);
                     UpdateWindow(hWnd);
                 }
@@ -1613,6 +1617,26 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         }
         validateItems(GetMenu(hWnd));
         break;
+    case WM_TIMER:
+        if (wParam==DRAW_TIMER)
+        {
+            int drawn[4];
+            if (!DrawMapStep(DRAW_STEP_CHUNKS,gHitsFound,drawn))
+            {
+                KillTimer(hWnd,DRAW_TIMER);
+                SendMessage(progressBar,PBM_SETPOS,0,0);
+            }
+            if (drawn[0]<drawn[2] && drawn[1]<drawn[3])
+            {
+                swapRedBlue(drawn[0],drawn[1],drawn[2],drawn[3]);
+                rect.left=drawn[0];
+                rect.right=drawn[2];
+                rect.top=MAIN_WINDOW_TOP+drawn[1];
+                rect.bottom=MAIN_WINDOW_TOP+drawn[3];
+                InvalidateRect(hWnd,&rect,FALSE);
+            }
+        }
+        break;
     case WM_ERASEBKGND:
         {
             hdc=(HDC)wParam;
@@ -1672,11 +1696,14 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         bitmap=CreateDIBSection(NULL,&bmi,DIB_RGB_COLORS,(void **)&map,NULL,0);
         if (hdcMem!=NULL)
             SelectObject(hdcMem,bitmap);
+        // a new bitmap, even if at the same address: nothing in it can be scrolled
+        DrawMapCancel();
 
-		// On resize, figure out a better hash table size for cache, if needed.
+		// On resize, ask the cache for room for the window, if needed. The cache
+		// won't go past what memory allows for this.
 		if ( (rect.bottom-rect.top) * (rect.right-rect.left) > 256 * gOptions.currentCacheSize )
 		{
-			// make new cache twice the size of the screen's needs, should be enough I hope.
+			// room for twice the blocks the screen shows, should be enough I hope.
 			gOptions.currentCacheSize = 2 * (rect.bottom-rect.top) * (rect.right-rect.left) / 256;
 			ChangeCache( gOptions.currentCacheSize );
 		}
@@ -1838,18 +1865,69 @@ static void updateProgress(float progress)
 static void draw()
 {
     if (gLoaded)
+    {
         DrawMap(gWorld,gCurX,gCurZ,gCurDepth,bitWidth,bitHeight,gCurScale,map,gOptions,gHitsFound,updateProgress);
+        swapDrawnAreas();
+    }
     else
+    {
+        // the next DrawMap can't scroll this
+        DrawMapCancel();
         memset(map,0xff,bitWidth*bitHeight*4);
+    }
     SendMessage(progressBar,PBM_SETPOS,0,0);
-    for (int i=0;i<bitWidth*bitHeight*4;i+=4)
+}
+
+// Zoom in or out by step, but below a zoom of 1 by halves, as the map is drawn there
+// from tiles shrunk by powers of two. Zooming out from above 1 stops at 1 first.
+static double zoomMap(double scale, int zoomIn, double step)
+{
+    if (zoomIn)
+        scale = (scale<1.0) ? scale*2.0 : scale+step;
+    else
+        scale = (scale>1.0) ? max(scale-step,1.0) : scale*0.5;
+    return clamp(scale,MINZOOM,MAXZOOM);
+}
+
+// draw the map with the blocks already read in, and have WM_TIMER read in and draw the rest
+static void drawInBackground(HWND hWnd)
+{
+    if (!gLoaded)
+    {
+        draw();
+        return;
+    }
+    if (DrawMapStart(gWorld,gCurX,gCurZ,gCurDepth,bitWidth,bitHeight,gCurScale,map,gOptions,gHitsFound,updateProgress))
+        SetTimer(hWnd,DRAW_TIMER,USER_TIMER_MINIMUM,NULL);
+    else
+        SendMessage(progressBar,PBM_SETPOS,0,0);
+    swapDrawnAreas();
+}
+
+// the map is drawn RGB, the bitmap wants BGR
+static void swapRedBlue(int left, int top, int right, int bottom)
+{
+    for (int y=top;y<bottom;y++)
     {
-        map[i]^=map[i+2];
-        map[i+2]^=map[i];
-        map[i]^=map[i+2];
+        for (int i=(y*bitWidth+left)*4;i<(y*bitWidth+right)*4;i+=4)
+        {
+            map[i]^=map[i+2];
+            map[i+2]^=map[i];
+            map[i]^=map[i+2];
+        }
     }
 }
 
+// DrawMap scrolls what it can of the last map; swap just what it drew
+static void swapDrawnAreas()
+{
+    int areas[2][4];
+    int count=GetMapDrawnAreas(areas);
+
+    for (int i=0;i<count;i++)
+        swapRedBlue(areas[i][0],areas[i][1],areas[i][2],areas[i][3]);
+}
+
 // return 1 if world could not be loaded
 static int loadWorld()
 {
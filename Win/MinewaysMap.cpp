@@ -35,15 +35,37 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #include "blockInfo.h"
 #include <assert.h>
 #include <string.h>
-
-static unsigned char* draw(const wchar_t *world,int bx,int bz,int y,Options opts,
-        ProgressCallback callback,float percent,int *hitsFound);
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define REMAP_SSE2
+#endif
+
+// how a 16x16 tile is scaled onto the map
+#define BLIT_MAX_SIZE (16*64)
+typedef struct BlitScale {
+    int size;                           // pixels across the tile on the map
+    int repeat;                         // each tile pixel's copies across, if a whole number; else 0
+    unsigned char src[BLIT_MAX_SIZE];   // the tile pixel for each across (and down)
+} BlitScale;
+
+// draws a block's 16x16 columns: see drawKernel()
+typedef void (*DrawKernel)(WorldBlock *block,WorldBlock *prevblock,int bx,int bz,int maxHeight,
+        unsigned int viewFilterFlags,int *hitsFound);
+
+struct DrawRows;
+static unsigned char* draw(const struct DrawRows *rows,WorldBlock *block,int bx,int bz,int *hitsFound);
+static DrawKernel drawKernelFor(Options opts);
 static void blit(unsigned char *block,unsigned char *bits,int px,int py,
-        double zoom,int w,int h);
+        const BlitScale *scale,int w,int h);
+static void setBlitScale(BlitScale *scale,double zoom);
 static void initColors();
 
 static int gColorsInited=0;
 static unsigned int gBlockColors[256*16];
+static int gBlockAlpha[256];    // out of 256; 0 for IDs past NUM_BLOCKS
 static unsigned char gEmptyR,gEmptyG,gEmptyB;
 static unsigned char gBlankTile[16*16*4];
 
@@ -74,6 +96,21 @@ static int gHighlightID=0;
 static int gUnknownBlock = 0;
 static int gPerformUnknownBlockCheck = 1;
 
+// per-thread decoders for LoadBlocks(), made on first use
+static ChunkDecoder *gLoadDecoders[MAX_WORKER_THREADS];
+
+// DrawMap reads this many chunks between progress reports
+#define DRAW_LOAD_SLICE 64
+// and draws rows of tiles in batches that fill at most this fraction of the cache
+#define DRAW_BATCH_DIVISOR 4
+
+// Zoomed out, the map is drawn from a pyramid of tiles, each of 16x16 pixels, each
+// level's tiles covering twice as many chunks across as the level below.
+#define PYRAMID_LEVELS 4        // so down to a zoom of 1/16
+#define PYRAMID_TILES 16384     // tiles kept, a power of two
+// rows of pyramid tiles are drawn in batches needing at most this many chunks
+#define DRAW_PYRAMID_CHUNKS 16384
+
 void SetHighlightState( int on, int minx, int miny, int minz, int maxx, int maxy, int maxz )
 {
     // we don't really require one to be min or max, we take the range
@@ -164,16 +201,395 @@ void GetHighlightState( int *on, int *minx, int *miny, int *minz, int *maxx, int
     *maxz = gBoxMaxZ;
 }
 
-//world = path to world saves
-//cx = center x world
-//cz = center z world
-//y = start depth
-//w = output width
-//h = output height
-//zoom = zoom amount (1.0 = 100%)
-//bits = byte array for output
-//opts = bitmasks of render options (see MinewaysMap.h)
-void DrawMap(const wchar_t *world,double cx,double cz,int y,int w,int h,double zoom,unsigned char *bits,Options opts, int *hitsFound, ProgressCallback callback)
+// the directory holding the region files for the world and dimension in opts
+static void mapDirectory(wchar_t directory[256],const wchar_t *world,Options opts)
+{
+    wcsncpy_s(directory,256,world,255);
+    wcsncat_s(directory,256,L"/",1);
+    if (opts.worldType&HELL)
+    {
+        wcsncat_s(directory,256,L"DIM-1/",6);
+    }
+    if (opts.worldType&ENDER)
+    {
+        wcsncat_s(directory,256,L"DIM1/",5);
+    }
+}
+
+// every block read for the map is kept in the cache, and held there until drawn
+static int keepDrawnBlock(int, int, WorldBlock *, int, void *)
+{
+    return 1;
+}
+
+// what DrawMap's worker threads share
+// data that threads write side by side is kept a cache line apart
+#define CACHE_LINE 64
+#ifdef _MSC_VER
+#define CACHE_ALIGN __declspec(align(64))
+#else
+#define CACHE_ALIGN __attribute__((aligned(64)))
+#endif
+
+typedef struct DrawRows {
+    int startxblock,startzblock;    // the chunk at the top left
+    int shiftx,shifty;              // how far its top left is off screen
+    int firstRow;                   // the batch's first row of tiles
+    int firstCol,lastCol;           // the tiles of each row to draw
+    int level;                      // pyramid level of the tiles, 0 for chunks
+    unsigned char *tiles;           // zoomed out, the batch's tiles
+    int tilesRow,tilesRows;         // and the rows of tiles they are
+    int hBlocks,blockScale;
+    int y,w,h;
+    double zoom;
+    BlitScale scale;                // for zoom
+    unsigned char *bits;
+    Options opts;
+    DrawKernel kernel;              // for opts
+    unsigned int viewFilterFlags;   // what's visible
+    DecodeRequest request;
+    // per thread, combined at the end. Each thread's are on a cache line of their own.
+    CACHE_ALIGN int hitsFound[MAX_WORKER_THREADS][CACHE_LINE/sizeof(int)];
+} DrawRows;
+
+// rows and columns of tiles to draw, counted from the one at the top left
+typedef struct MapArea {
+    int firstRow,lastRow;
+    int firstCol,lastCol;
+} MapArea;
+
+// A map render that's under way. DrawMap runs one to the end; DrawMapStart and
+// DrawMapStep run one a slice at a time. Starting another drops this one.
+typedef struct MapRender {
+    int active;
+    DrawRows rows;
+    wchar_t directory[256];
+    int vBlocks;
+    MapArea areas[2];                       // the whole view, or the strips a pan brought into it
+    int areaCount,area;                     // how many, and the one being drawn
+    int batchFirst,batchLast,batchRows;     // the rows of tiles being read in
+    ChunkCoord *coords;                     // the batch's blocks that need reading
+    int coordsSize;
+    int count,next;                         // how many there are, and the next to read
+    int listed;                             // coords holds the batch's blocks
+    int progressive;                        // everything was drawn once: redraw as blocks come in
+    int redraw;                             // the batch changed but for what was read in
+    unsigned char *tiles;                   // zoomed out, the pixels of the batch's tiles
+    char *building;                         // which of them are being made from chunks
+    int tilesSize;
+    ProgressCallback callback;
+} MapRender;
+
+static MapRender gRender;
+
+// what the map shows, and what it shows too with SHOWALL
+#define MAP_VIEW_FLAGS (BLF_WHOLE | BLF_ALMOST_WHOLE | BLF_STAIRS | BLF_HALF | BLF_MIDDLER | BLF_BILLBOARD | BLF_PANE | BLF_FLATTOP)
+#define MAP_SHOWALL_FLAGS (BLF_FLATSIDE | BLF_SMALL_MIDDLER | BLF_SMALL_BILLBOARD)
+
+// The last view drawn to the end. If the next is the same but for where it's
+// centered, bits is scrolled and only what comes into view is drawn.
+typedef struct MapView {
+    int valid;
+    DrawRows rows;
+    wchar_t directory[256];
+    int highlightID;
+    unsigned short colormap;
+} MapView;
+
+static MapView gLastView;
+
+// the areas of bits the last DrawMap or DrawMapStart drew, as left,top,right,bottom
+static int gDrawnAreas[2][4];
+static int gDrawnCount=0;
+
+// a tile of the pyramid, and what it was drawn with
+typedef struct PyramidTile {
+    int used;
+    int level,tx,tz;
+    int y,worldType,highlightID;
+    unsigned short colormap;
+    unsigned char pixels[16*16*4];
+} PyramidTile;
+
+// PYRAMID_TILES of them, each tile having one place it can go
+static PyramidTile *gPyramid=NULL;
+
+static PyramidTile *pyramidSlot(int level,int tx,int tz)
+{
+    unsigned int hash=((unsigned int)tx*73856093u)^((unsigned int)tz*19349663u)^((unsigned int)level*83492791u);
+    return &gPyramid[hash&(PYRAMID_TILES-1)];
+}
+
+// the pyramid tile's pixels, if it's kept and drawn with what rows draws with
+static unsigned char *findPyramidTile(DrawRows *rows,int level,int tx,int tz)
+{
+    PyramidTile *tile;
+
+    if (gPyramid==NULL)
+        return NULL;
+    tile=pyramidSlot(level,tx,tz);
+    if (tile->used && tile->level==level && tile->tx==tx && tile->tz==tz &&
+        tile->y==rows->y && tile->worldType==rows->opts.worldType &&
+        tile->highlightID==gHighlightID && tile->colormap==gColormap)
+        return tile->pixels;
+    return NULL;
+}
+
+static void storePyramidTile(DrawRows *rows,int level,int tx,int tz,unsigned char *pixels)
+{
+    PyramidTile *tile;
+
+    if (gPyramid==NULL)
+    {
+        gPyramid=(PyramidTile *)calloc(PYRAMID_TILES,sizeof(PyramidTile));
+        if (gPyramid==NULL)
+            return;
+    }
+    tile=pyramidSlot(level,tx,tz);
+    tile->used=1;
+    tile->level=level;
+    tile->tx=tx;
+    tile->tz=tz;
+    tile->y=rows->y;
+    tile->worldType=rows->opts.worldType;
+    tile->highlightID=gHighlightID;
+    tile->colormap=gColormap;
+    memcpy(tile->pixels,pixels,16*16*4);
+}
+
+// average 16x16 pixels down by 2^shift each way, into the 16x16 dest at px,pz
+static void shrinkPixels(const unsigned char *src,int shift,unsigned char *dest,int px,int pz)
+{
+    int size=16>>shift;
+    int n=1<<shift;
+    int x,z,i,j,c,sum;
+
+    for (z=0;z<size;z++)
+    {
+        for (x=0;x<size;x++)
+        {
+            for (c=0;c<4;c++)
+            {
+                sum=0;
+                for (j=0;j<n;j++)
+                    for (i=0;i<n;i++)
+                        sum+=src[(((z<<shift)+j)*16+(x<<shift)+i)*4+c];
+                dest[((pz+z)*16+px+x)*4+c]=(unsigned char)(sum>>(2*shift));
+            }
+        }
+    }
+}
+
+// make a pyramid tile from the four below it, if they are all kept; 1 if made
+static int shrinkChildren(DrawRows *rows,int level,int tx,int tz,unsigned char *dest)
+{
+    unsigned char *child[4];
+    int i;
+
+    for (i=0;i<4;i++)
+    {
+        child[i]=findPyramidTile(rows,level-1,tx*2+(i&1),tz*2+(i>>1));
+        if (child[i]==NULL)
+            return 0;
+    }
+    for (i=0;i<4;i++)
+        shrinkPixels(child[i],1,dest,(i&1)*8,(i>>1)*8);
+    return 1;
+}
+
+// the pixels of a pyramid tile for drawRowJob: the batch's own, or those kept
+static unsigned char *pyramidPixels(DrawRows *rows,int x,int z)
+{
+    unsigned char *pixels;
+
+    if (z>=rows->tilesRow && z<rows->tilesRow+rows->tilesRows)
+        return rows->tiles+((z-rows->tilesRow)*(rows->hBlocks+1)+x)*16*16*4;
+    pixels=findPyramidTile(rows,rows->level,rows->startxblock+x,rows->startzblock+z);
+    return (pixels!=NULL) ? pixels : gBlankTile;
+}
+
+// Draw a row of tiles, west to east: each tile is shaded using the one to its west.
+// The cache isn't touched but to look blocks up, and each row has its own pixels.
+static void drawRowJob(int index, int thread, void *userData)
+{
+    DrawRows *rows=(DrawRows *)userData;
+    int z=rows->firstRow+index;
+    int x,px,py=z*rows->blockScale-rows->shifty;
+    int bx,bz=rows->startzblock+z;
+    unsigned char *blockbits;
+
+    // z increases west, decreases east
+    for (x=rows->firstCol,px=x*rows->blockScale-rows->shiftx;x<=rows->lastCol;x++,px+=rows->blockScale)
+    {
+        bx=rows->startxblock+x;
+        if (rows->level>0)
+            blockbits=pyramidPixels(rows,x,z);
+        else
+            blockbits=draw(rows,(WorldBlock *)Cache_Peek(bx,bz),bx,bz,rows->hitsFound[thread]);
+        blit(blockbits,rows->bits,px,py,&rows->scale,rows->w,rows->h);
+    }
+}
+
+// the pixels covered by rows firstRow..lastRow of the area's tiles, as left,top,right,bottom
+static void areaPixels(DrawRows *rows,MapArea *area,int firstRow,int lastRow,int rect[4])
+{
+    rect[0]=clamp(area->firstCol*rows->blockScale-rows->shiftx,0,rows->w);
+    rect[1]=clamp(firstRow*rows->blockScale-rows->shifty,0,rows->h);
+    rect[2]=clamp((area->lastCol+1)*rows->blockScale-rows->shiftx,0,rows->w);
+    rect[3]=clamp((lastRow+1)*rows->blockScale-rows->shifty,0,rows->h);
+}
+
+// set up the per-thread hits for a parallel pass
+static void startHits(DrawRows *rows,int *hitsFound)
+{
+    int i;
+
+    for (i=0;i<MAX_WORKER_THREADS;i++)
+    {
+        rows->hitsFound[i][0]=rows->hitsFound[i][1]=rows->hitsFound[i][2]=0;
+        rows->hitsFound[i][3]=hitsFound[3];
+    }
+}
+
+// and add what they found to hitsFound
+static void finishHits(DrawRows *rows,int *hitsFound)
+{
+    int i,j;
+
+    for (i=0;i<MAX_WORKER_THREADS;i++)
+    {
+        for (j=0;j<3;j++)
+            hitsFound[j]|=rows->hitsFound[i][j];
+        hitsFound[3]=min(hitsFound[3],rows->hitsFound[i][3]);
+    }
+}
+
+// draw rows firstRow..lastRow of the current area in parallel, with whatever is in
+// the cache, and widen rect to cover the pixels drawn
+static void drawRows(MapRender *render,int firstRow,int lastRow,int *hitsFound,int rect[4])
+{
+    DrawRows *rows=&render->rows;
+    MapArea *area=&render->areas[render->area];
+    int drawn[4];
+
+    startHits(rows,hitsFound);
+    rows->firstRow=firstRow;
+    rows->firstCol=area->firstCol;
+    rows->lastCol=area->lastCol;
+    RunParallel(lastRow-firstRow+1,drawRowJob,rows);
+    finishHits(rows,hitsFound);
+
+    areaPixels(rows,area,firstRow,lastRow,drawn);
+    rect[0]=min(rect[0],drawn[0]);
+    rect[1]=min(rect[1],drawn[1]);
+    rect[2]=max(rect[2],drawn[2]);
+    rect[3]=max(rect[3],drawn[3]);
+}
+
+// move the w x h image in bits dx pixels right and dy down; what's moved in is left as it was
+static void scrollBits(unsigned char *bits,int w,int h,int dx,int dy)
+{
+    int y;
+    int from=(dx<0 ? -dx : 0)*4;
+    int to=(dx>0 ? dx : 0)*4;
+    int width=(w-abs(dx))*4;
+
+    if (dy>0)
+    {
+        for (y=h-1;y>=dy;y--)
+            memmove(bits+y*w*4+to,bits+(y-dy)*w*4+from,width);
+    }
+    else
+    {
+        for (y=0;y<h+dy;y++)
+            memmove(bits+y*w*4+to,bits+(y-dy)*w*4+from,width);
+    }
+}
+
+// If the view is the last one moved over, scroll bits to match and set the render to
+// draw just the rows and columns of tiles that came into view. 0 if it must all be drawn.
+// rows->zoom is the tiles' scale, which is the same at each level of the pyramid (1.0
+// for chunks at zoom 1, and for level 1 tiles at zoom 0.5), so the level is checked too.
+// The same bits pointer and size don't prove the pixels are still there: whoever
+// replaces the buffer calls DrawMapCancel, which clears gLastView.valid.
+static int scrollLastView(MapRender *render)
+{
+    DrawRows *rows=&render->rows;
+    DrawRows *last=&gLastView.rows;
+    int dx,dy,firstRow,lastRow;
+    MapArea *area;
+
+    if (!gLastView.valid ||
+        last->bits!=rows->bits || last->w!=rows->w || last->h!=rows->h ||
+        last->zoom!=rows->zoom || last->level!=rows->level || last->y!=rows->y ||
+        last->opts.worldType!=rows->opts.worldType ||
+        gLastView.highlightID!=gHighlightID || gLastView.colormap!=gColormap ||
+        wcscmp(gLastView.directory,render->directory)!=0)
+        return 0;
+
+    // how far a tile's pixels have moved; any tile's will do
+    dx=(last->startxblock-rows->startxblock)*rows->blockScale+last->shiftx-rows->shiftx;
+    dy=(last->startzblock-rows->startzblock)*rows->blockScale+last->shifty-rows->shifty;
+    if (abs(dx)>=rows->w || abs(dy)>=rows->h)
+        return 0;
+
+    scrollBits(rows->bits,rows->w,rows->h,dx,dy);
+
+    // rows of tiles moved in at the top or bottom
+    render->areaCount=0;
+    firstRow=0;
+    lastRow=render->vBlocks;
+    if (dy!=0)
+    {
+        area=&render->areas[render->areaCount++];
+        area->firstCol=0;
+        area->lastCol=rows->hBlocks;
+        if (dy>0)
+        {
+            area->firstRow=0;
+            area->lastRow=(dy-1+rows->shifty)/rows->blockScale;
+            firstRow=area->lastRow+1;
+        }
+        else
+        {
+            area->firstRow=(rows->h+dy+rows->shifty)/rows->blockScale;
+            area->lastRow=render->vBlocks;
+            lastRow=area->firstRow-1;
+        }
+    }
+    // and columns at the sides, in the rest of the rows
+    if (dx!=0 && firstRow<=lastRow)
+    {
+        area=&render->areas[render->areaCount++];
+        area->firstRow=firstRow;
+        area->lastRow=lastRow;
+        if (dx>0)
+        {
+            // the column after the new ones has a block to its west to shade with now
+            area->firstCol=0;
+            area->lastCol=min((dx-1+rows->shiftx)/rows->blockScale+1,rows->hBlocks);
+        }
+        else
+        {
+            area->firstCol=(rows->w+dx+rows->shiftx)/rows->blockScale;
+            area->lastCol=rows->hBlocks;
+        }
+    }
+    return 1;
+}
+
+// the render has drawn everything: remember the view for the next one to scroll
+static void finishRender(MapRender *render)
+{
+    gLastView.valid=1;
+    gLastView.rows=render->rows;
+    wcsncpy_s(gLastView.directory,256,render->directory,255);
+    gLastView.highlightID=gHighlightID;
+    gLastView.colormap=gColormap;
+}
+
+// set up gRender to draw the view; 0 if out of memory
+static int startRender(const wchar_t *world,double cx,double cz,int y,int w,int h,double zoom,unsigned char *bits,Options opts,ProgressCallback callback)
 {
     /* We're converting between coordinate systems, so this gets kinda ugly 
      *
@@ -196,9 +612,16 @@ void DrawMap(const wchar_t *world,double cx,double cz,int y,int w,int h,double z
     // the code to make -z to be north, for the release. If you add this, it should be an option,
     // so that old players (like me) can use "old north". TODO
 
-    unsigned char *blockbits;
-    int z,x,px,py;
-    int blockScale=(int)(16*zoom);
+    MapRender *render=&gRender;
+    int i,size,tileChunks;
+    int level=0;
+
+    // Zoomed out, each tile on screen is a pyramid tile 2^level chunks across,
+    // shown at half to full size
+    while (level<PYRAMID_LEVELS && zoom*(2<<level)<=1.0)
+        level++;
+    int blockSize=16<<level;    // in blocks of the world
+    int blockScale=(int)(blockSize*zoom);
 
     // number of blocks to fill the screen (plus 2 blocks for floating point inaccuracy)
     int hBlocks=(w+blockScale*2)/blockScale;
@@ -210,10 +633,10 @@ void DrawMap(const wchar_t *world,double cx,double cz,int y,int w,int h,double z
 	double startz=cz-(double)h/(2*zoom);
     // TODO: I suspect these want to be floors, not ints; int
     // rounds towards 0, floor takes -4.5 and goes to -5.
-    int startxblock=(int)(startx/16);
-    int startzblock=(int)(startz/16);
-	int shiftx=(int)((startx-startxblock*16)*zoom);
-	int shifty=(int)((startz-startzblock*16)*zoom);
+    int startxblock=(int)(startx/blockSize);
+    int startzblock=(int)(startz/blockSize);
+	int shiftx=(int)((startx-startxblock*blockSize)*zoom);
+	int shifty=(int)((startz-startzblock*blockSize)*zoom);
 
     if (shiftx<0)
     {
@@ -226,19 +649,328 @@ void DrawMap(const wchar_t *world,double cx,double cz,int y,int w,int h,double z
         shifty+=blockScale;
     }
 
+    // whatever was left of the last render is dropped
+    if (render->active)
+        Cache_ReleaseHeld();
+    render->active=0;
+    gDrawnCount=0;
+
     if (!gColorsInited)
         initColors();
 
-    // x increases south, decreases north
-    for (z=0,py=-shifty;z<=vBlocks;z++,py+=blockScale)
+    // the map needs light only when lighting things
+    render->rows.request.channels=DECODE_BLOCKS | ((opts.worldType&LIGHTING) ? DECODE_LIGHT : 0);
+    render->rows.request.minSection=0;
+    render->rows.request.maxSection=15;
+    mapDirectory(render->directory,world,opts);
+
+    render->rows.startxblock=startxblock;
+    render->rows.startzblock=startzblock;
+    render->rows.shiftx=shiftx;
+    render->rows.shifty=shifty;
+    render->rows.hBlocks=hBlocks;
+    render->rows.blockScale=blockScale;
+    render->rows.level=level;
+    render->rows.tilesRows=0;
+    render->rows.y=y;
+    render->rows.w=w;
+    render->rows.h=h;
+    render->rows.zoom=zoom*(1<<level);
+    setBlitScale(&render->rows.scale,render->rows.zoom);
+    render->rows.bits=bits;
+    render->rows.opts=opts;
+    render->rows.kernel=drawKernelFor(opts);
+    render->rows.viewFilterFlags=MAP_VIEW_FLAGS | ((opts.worldType&SHOWALL)?MAP_SHOWALL_FLAGS:0x0);   // what's visible
+    render->vBlocks=vBlocks;
+    render->callback=callback;
+
+    // Each batch of rows is read in on this thread, as the cache needs, then drawn in
+    // parallel. The cache holds on to the whole batch until it's drawn. Chunks read
+    // for pyramid tiles aren't kept, but they all have to be listed.
+    tileChunks=1<<(2*level);
+    if (level>0)
+        render->batchRows=DRAW_PYRAMID_CHUNKS/tileChunks/(hBlocks+1);
+    else
+        render->batchRows=(int)(Cache_GetBudget()/sizeof(WorldBlock)/DRAW_BATCH_DIVISOR/(hBlocks+1));
+    render->batchRows=clamp(render->batchRows,1,vBlocks+1);
+    size=render->batchRows*(hBlocks+1);
+    if (level>0 && size>render->tilesSize)
+    {
+        free(render->tiles);
+        free(render->building);
+        render->tiles=(unsigned char *)malloc(size*16*16*4);
+        render->building=(char *)malloc(size);
+        render->tilesSize=size;
+        if (render->tiles==NULL || render->building==NULL)
+        {
+            free(render->tiles);
+            free(render->building);
+            render->tiles=NULL;
+            render->building=NULL;
+            render->tilesSize=0;
+            gLastView.valid=0;
+            return 0;
+        }
+    }
+    render->rows.tiles=render->tiles;
+    size*=tileChunks;
+    if (size>render->coordsSize)
     {
-        // z increases west, decreases east
-        for (x=0,px=-shiftx;x<=hBlocks;x++,px+=blockScale)
+        free(render->coords);
+        render->coords=(ChunkCoord *)malloc(size*sizeof(ChunkCoord));
+        render->coordsSize=(render->coords==NULL) ? 0 : size;
+        if (render->coords==NULL)
         {
-            blockbits = draw(world,startxblock+x,startzblock+z,y,opts,callback,(float)(z*hBlocks+x)/(float)(vBlocks*hBlocks),hitsFound);
-            blit(blockbits,bits,px,py,zoom,w,h);
+            gLastView.valid=0;
+            return 0;
         }
     }
+
+    // a pure pan needs only the strips moved into view; else draw it all
+    if (!scrollLastView(render))
+    {
+        render->areaCount=1;
+        render->areas[0].firstRow=0;
+        render->areas[0].lastRow=vBlocks;
+        render->areas[0].firstCol=0;
+        render->areas[0].lastCol=hBlocks;
+    }
+    // until this render is done, bits doesn't hold a view to scroll
+    gLastView.valid=0;
+
+    for (i=0;i<render->areaCount;i++)
+        areaPixels(&render->rows,&render->areas[i],render->areas[i].firstRow,render->areas[i].lastRow,gDrawnAreas[gDrawnCount++]);
+
+    render->area=0;
+    render->batchFirst=render->areas[0].firstRow;
+    render->listed=0;
+    render->progressive=0;
+    render->redraw=0;
+    render->active=(render->areaCount>0);
+    if (!render->active)
+        finishRender(render);
+    return 1;
+}
+
+// LoadBlocks callback for chunks under pyramid tiles: draw the chunk, shrink it into
+// its tile, and let it go
+static int shrinkReadChunk(int cx, int cz, WorldBlock *block, int thread, void *userData)
+{
+    MapRender *render=(MapRender *)userData;
+    DrawRows *rows=&render->rows;
+    int level=rows->level;
+    int tx=cx>>level;
+    int tz=cz>>level;
+    int size=16>>level;
+    unsigned char *tile=rows->tiles+((tz-rows->startzblock-rows->tilesRow)*(rows->hBlocks+1)+tx-rows->startxblock)*16*16*4;
+
+    shrinkPixels(draw(rows,block,cx,cz,rows->hitsFound[thread]),level,
+        tile,(cx-(tx<<level))*size,(cz-(tz<<level))*size);
+    return 0;
+}
+
+// Get the batch's pyramid tiles ready and list the chunks that need reading. Tiles
+// kept are copied. The rest are shrunk from the level below if it has them all, or
+// else started from the chunks in the cache, to be finished as the others are read.
+static void listPyramidBatch(MapRender *render,int *hitsFound)
+{
+    DrawRows *rows=&render->rows;
+    MapArea *area=&render->areas[render->area];
+    int level=rows->level;
+    int n=1<<level;
+    int size=16>>level;
+    int x,z,i,j,tx,tz,cx,cz;
+    unsigned char *tile,*pixels;
+    WorldBlock *block;
+
+    rows->tilesRow=render->batchFirst;
+    rows->tilesRows=render->batchLast-render->batchFirst+1;
+    render->count=0;
+    for (z=render->batchFirst;z<=render->batchLast;z++)
+    {
+        for (x=area->firstCol;x<=area->lastCol;x++)
+        {
+            i=(z-render->batchFirst)*(rows->hBlocks+1)+x;
+            tile=rows->tiles+i*16*16*4;
+            tx=rows->startxblock+x;
+            tz=rows->startzblock+z;
+            render->building[i]=0;
+
+            pixels=findPyramidTile(rows,level,tx,tz);
+            if (pixels!=NULL)
+            {
+                memcpy(tile,pixels,16*16*4);
+                continue;
+            }
+            render->redraw=1;
+            if (shrinkChildren(rows,level,tx,tz,tile))
+            {
+                storePyramidTile(rows,level,tx,tz,tile);
+                continue;
+            }
+
+            render->building[i]=1;
+            for (j=0;j<n*n;j++)
+            {
+                cx=(tx<<level)+j%n;
+                cz=(tz<<level)+j/n;
+                block=(WorldBlock *)Cache_Peek(cx,cz);
+                if (block!=NULL && BLOCK_HAS(block,&rows->request))
+                {
+                    pixels=draw(rows,block,cx,cz,hitsFound);
+                }
+                else
+                {
+                    // blank until it's read in, and after if it isn't there
+                    pixels=gBlankTile;
+                    render->coords[render->count].cx=cx;
+                    render->coords[render->count].cz=cz;
+                    render->count++;
+                }
+                shrinkPixels(pixels,level,tile,(j%n)*size,(j/n)*size);
+            }
+        }
+    }
+}
+
+// the batch's chunks are all read: keep the tiles made from them
+static void keepPyramidBatch(MapRender *render)
+{
+    DrawRows *rows=&render->rows;
+    MapArea *area=&render->areas[render->area];
+    int x,z,i;
+
+    for (z=render->batchFirst;z<=render->batchLast;z++)
+    {
+        for (x=area->firstCol;x<=area->lastCol;x++)
+        {
+            i=(z-render->batchFirst)*(rows->hBlocks+1)+x;
+            if (render->building[i])
+                storePyramidTile(rows,rows->level,rows->startxblock+x,rows->startzblock+z,rows->tiles+i*16*16*4);
+        }
+    }
+    rows->tilesRows=0;
+}
+
+// Read in up to maxChunks blocks (any number, if negative) and draw them. The
+// pixels drawn, all within one area, are added to rect. Returns 1 if there's more to do.
+static int stepRender(int maxChunks,int *hitsFound,int rect[4])
+{
+    MapRender *render=&gRender;
+    DrawRows *rows=&render->rows;
+    MapArea *area;
+    WorldBlock *block;
+    int x,z,i,n,cached,done,total,read=0;
+
+    while (render->active)
+    {
+        // the highlight may have been turned on or off between steps
+        rows->kernel=drawKernelFor(rows->opts);
+        area=&render->areas[render->area];
+        if (!render->listed && rows->level>0)
+        {
+            render->batchLast=min(render->batchFirst+render->batchRows-1,area->lastRow);
+            listPyramidBatch(render,hitsFound);
+            render->next=0;
+            render->listed=1;
+        }
+        else if (!render->listed)
+        {
+            render->batchLast=min(render->batchFirst+render->batchRows-1,area->lastRow);
+
+            // The batch's blocks are held until it's drawn, so that reading the rest
+            // can't push them out, and each counts as a use. A block read for an
+            // export may lack sections or light; read it again.
+            render->count=0;
+            for (z=render->batchFirst;z<=render->batchLast;z++)
+            {
+                for (x=area->firstCol;x<=area->lastCol;x++)
+                {
+                    // a packed block brought back hasn't been drawn yet
+                    cached=(Cache_Peek(rows->startxblock+x,rows->startzblock+z)!=NULL);
+                    block=(WorldBlock *)Cache_Hold(rows->startxblock+x,rows->startzblock+z);
+                    render->redraw|=(!cached && block!=NULL);
+                    if (block==NULL || !BLOCK_HAS(block,&rows->request))
+                    {
+                        render->coords[render->count].cx=rows->startxblock+x;
+                        render->coords[render->count].cz=rows->startzblock+z;
+                        render->count++;
+                    }
+                }
+            }
+            render->next=0;
+            render->listed=1;
+        }
+
+        if (render->next<render->count)
+        {
+            if (maxChunks>=0 && read>=maxChunks)
+                break;
+            n=min(DRAW_LOAD_SLICE,render->count-render->next);
+            if (rows->level>0)
+            {
+                startHits(rows,hitsFound);
+                LoadBlocks(render->directory,render->coords+render->next,n,&rows->request,shrinkReadChunk,render);
+                finishHits(rows,hitsFound);
+            }
+            else
+            {
+                LoadBlocks(render->directory,render->coords+render->next,n,&rows->request,keepDrawnBlock,NULL);
+                for (i=render->next;i<render->next+n;i++)
+                    Cache_Hold(render->coords[i].cx,render->coords[i].cz);
+            }
+            render->next+=n;
+            read+=n;
+
+            //let's only update the progress bar if we're loading
+            if (render->callback)
+            {
+                // how far through the area's chunks, then through the areas
+                done=(render->batchFirst-area->firstRow)*(area->lastCol-area->firstCol+1)*(1<<(2*rows->level))+render->next;
+                total=(area->lastRow-area->firstRow+1)*(area->lastCol-area->firstCol+1)*(1<<(2*rows->level));
+                render->callback(((float)render->area+(float)done/(float)total)/(float)render->areaCount);
+            }
+
+            // show what's come in so far
+            if (render->progressive)
+            {
+                drawRows(render,render->batchFirst,render->batchLast,hitsFound,rect);
+                render->redraw=0;
+            }
+            continue;
+        }
+
+        // A progressive render has drawn these rows already, as their blocks came in
+        if (!render->progressive || render->redraw)
+            drawRows(render,render->batchFirst,render->batchLast,hitsFound,rect);
+        render->redraw=0;
+        if (rows->level>0)
+            keepPyramidBatch(render);
+        Cache_ReleaseHeld();
+
+        render->batchFirst+=render->batchRows;
+        render->listed=0;
+        if (render->batchFirst>area->lastRow)
+        {
+            if (++render->area>=render->areaCount)
+            {
+                render->active=0;
+                finishRender(render);
+            }
+            else
+            {
+                render->batchFirst=render->areas[render->area].firstRow;
+                // what's drawn is reported an area at a time
+                if (rect[0]<rect[2] && rect[1]<rect[3])
+                    break;
+            }
+        }
+    }
+    return render->active;
+}
+
+static void updateDirtyBox()
+{
     // clear dirty rectangle, if any
     if ( gBoxHighlightUsed )
     {
@@ -259,6 +991,76 @@ void DrawMap(const wchar_t *world,double cx,double cz,int y,int w,int h,double z
     }
 }
 
+//world = path to world saves
+//cx = center x world
+//cz = center z world
+//y = start depth
+//w = output width
+//h = output height
+//zoom = zoom amount (1.0 = 100%); below 1, powers of two down to 1/16 look best
+//bits = byte array for output
+//opts = bitmasks of render options (see MinewaysMap.h)
+void DrawMap(const wchar_t *world,double cx,double cz,int y,int w,int h,double zoom,unsigned char *bits,Options opts, int *hitsFound, ProgressCallback callback)
+{
+    int rect[4]={w,h,0,0};
+
+    if (!startRender(world,cx,cz,y,w,h,zoom,bits,opts,callback))
+        return;
+    stepRender(-1,hitsFound,rect);
+    updateDirtyBox();
+}
+
+// Like DrawMap, but returns at once. Tiles whose blocks are in the cache are drawn,
+// the rest are left blank for DrawMapStep to fill in. bits must be kept until then.
+// Returns 1 if there are blocks to read in, 0 if the map is all drawn.
+int DrawMapStart(const wchar_t *world,double cx,double cz,int y,int w,int h,double zoom,unsigned char *bits,Options opts, int *hitsFound, ProgressCallback callback)
+{
+    int rect[4]={w,h,0,0};
+
+    if (!startRender(world,cx,cz,y,w,h,zoom,bits,opts,callback))
+        return 0;
+    if (gRender.active)
+    {
+        for (gRender.area=0;gRender.area<gRender.areaCount;gRender.area++)
+            drawRows(&gRender,gRender.areas[gRender.area].firstRow,gRender.areas[gRender.area].lastRow,hitsFound,rect);
+        gRender.area=0;
+        gRender.progressive=1;
+    }
+    updateDirtyBox();
+    // see if everything is there, without reading anything in
+    return stepRender(0,hitsFound,rect);
+}
+
+// Read in up to maxChunks of the blocks DrawMapStart left out, and draw them.
+// rect is set to the left,top,right,bottom of the pixels redrawn, empty if none.
+// Returns 1 if there is more to do, 0 once the map is done or was cancelled.
+int DrawMapStep(int maxChunks, int *hitsFound, int rect[4])
+{
+    rect[0]=gRender.rows.w;
+    rect[1]=gRender.rows.h;
+    rect[2]=rect[3]=0;
+    return stepRender(maxChunks,hitsFound,rect);
+}
+
+// Drop what's left of a DrawMapStart, and forget the view last drawn. Call this
+// whenever bits is replaced or drawn over by anyone else: a buffer can't be told
+// from a new one at the same address, and the next draw would scroll what it holds.
+void DrawMapCancel()
+{
+    if (gRender.active)
+        Cache_ReleaseHeld();
+    gRender.active=0;
+    gLastView.valid=0;
+}
+
+// The parts of bits the last DrawMap or DrawMapStart drew, as left,top,right,bottom
+// in pixels; the rest was scrolled over from the view drawn before. Returns how many.
+int GetMapDrawnAreas(int areas[2][4])
+{
+    memcpy(areas,gDrawnAreas,gDrawnCount*sizeof(gDrawnAreas[0]));
+    return gDrawnCount;
+}
+
 //bx = x coord of pixel
 //by = y coord of pixel
 //cx = center x world
@@ -346,145 +1148,136 @@ const char *IDBlock(int bx, int by, double cx, double cz, int w, int h, double z
 }
 
 
-//copy block to bits at px,py at zoom.  bits is wxh
-static void blit(unsigned char *block,unsigned char *bits,int px,int py,
-    double zoom,int w,int h)
-{
-    int x,y,yofs,bitofs;
-    int skipx=0,skipy=0;
-    int bw=(int)(16*zoom);
-    int bh=(int)(16*zoom);
-    if (px<0) skipx=-px;
-    if (px+bw>=w) bw=w-px;
-    if (bw<=0) return;
-    if (py<0) skipy=-py;
-    if (py+bh>=h) bh=h-py;
-    if (bh<=0) return;
-    bits+=py*w*4;
-    bits+=px*4;
-    for (y=0;y<bh;y++,bits+=w<<2)
-    {
-        if (y<skipy) continue;
-        yofs=((int)(y/zoom))<<6;
-        bitofs=0;
-        if (zoom == 1.0 && skipx == 0 && bw == 16) {
-            memcpy(bits+bitofs,block+yofs,16*4);
-        } else {
-            for (x=0;x<bw;x++,bitofs+=4)
-            {
-                if (x<skipx) continue;
-                memcpy(bits+bitofs,block+yofs+(((int)(x/zoom))<<2),4);
-            }
-        }
-    }
-}
-
-void CloseAll()
+// work out which tile pixel goes where at a zoom, so blit needn't
+static void setBlitScale(BlitScale *scale,double zoom)
 {
-    Cache_Empty();
+    int x;
+
+    scale->size=min((int)(16*zoom),BLIT_MAX_SIZE);
+    scale->repeat=(zoom==(int)zoom) ? (int)zoom : 0;
+    for (x=0;x<scale->size;x++)
+        scale->src[x]=(unsigned char)min((int)(x/zoom),15);
 }
 
-// Draw a block at chunk bx,bz
-// opts is a bitmask representing render options (see MinewaysMap.h)
-// returns 16x16 set of block colors to use to render map.
-// colors are adjusted by height, transparency, etc.
-static unsigned char* draw(const wchar_t *world,int bx,int bz,int maxHeight,Options opts,ProgressCallback callback,float percent,int *hitsFound)
+// scale a row of a tile's pixels across, for pixels x0..x1-1 of the row on the map
+static void scaleRow(const unsigned int *src,unsigned int *dest,const BlitScale *scale,int x0,int x1)
 {
-    WorldBlock *block, *prevblock;
-    int ofs=0,prevy,bofs,prevSely,blockSolid;
-    //int hasSlime = 0;
-    int x,z,i;
-    unsigned int color, viewFilterFlags;
-    unsigned char voxel, r, g, b, seenempty;
-    double alpha, blend;
-
-    char cavemode, showobscured, depthshading, lighting;
-    unsigned char *bits;
-
-//    if ((opts.worldType&(HELL|ENDER|SLIME))==SLIME)
-//            hasSlime = isSlimeChunk(bx, bz);
-
-    cavemode=!!(opts.worldType&CAVEMODE);
-    showobscured=!(opts.worldType&HIDEOBSCURED);
-    depthshading=!!(opts.worldType&DEPTHSHADING);
-    lighting=!!(opts.worldType&LIGHTING);
-    viewFilterFlags= BLF_WHOLE | BLF_ALMOST_WHOLE | BLF_STAIRS | BLF_HALF | BLF_MIDDLER | BLF_BILLBOARD | BLF_PANE | BLF_FLATTOP |   // what's visible
-        ((opts.worldType&SHOWALL)?(BLF_FLATSIDE|BLF_SMALL_MIDDLER|BLF_SMALL_BILLBOARD):0x0);
-
-    block=(WorldBlock *)Cache_Find(bx,bz);
+    int x;
 
-    if (block==NULL)
+    if (scale->repeat==1)
     {
-        wchar_t directory[256];
-        wcsncpy_s(directory,256,world,255);
-        wcsncat_s(directory,256,L"/",1);
-        if (opts.worldType&HELL)
-        {
-            wcsncat_s(directory,256,L"DIM-1/",6);
-        }
-        if (opts.worldType&ENDER)
+        memcpy(dest+x0,src+x0,(x1-x0)*4);
+        return;
+    }
+#ifdef REMAP_SSE2
+    if (scale->repeat>=4)
+    {
+        int i,end;
+        __m128i pixel;
+
+        // at a whole zoom of 4 or more, each tile pixel fills whole runs of four
+        for (x=x0;x<x1;x=end)
         {
-            wcsncat_s(directory,256,L"DIM1/",5);
+            i=scale->src[x];
+            end=min((i+1)*scale->repeat,x1);
+            pixel=_mm_set1_epi32((int)src[i]);
+            for (;x+4<=end;x+=4)
+                _mm_storeu_si128((__m128i *)(dest+x),pixel);
+            for (;x<end;x++)
+                dest[x]=src[i];
         }
-
-		block=LoadBlock(directory,bx,bz);
-        if (block==NULL) //blank tile
-            return gBlankTile;
-
-        //let's only update the progress bar if we're loading
-        if (callback)
-            callback(percent);
-
-        Cache_Add(bx,bz,block);
+        return;
     }
+#endif
+    for (x=x0;x<x1;x++)
+        dest[x]=src[scale->src[x]];
+}
 
-	// At this point the block is loaded.
-
-	// Is it inside highlighted area?
-	bool isInside = ( bx >= gDirtyBoxMinX-1 && bx <= gDirtyBoxMaxX &&
-		bz >= gDirtyBoxMinZ-1 && bz <= gDirtyBoxMaxZ );
-
-	// already rendered?
-    if (block->rendery==maxHeight && block->renderopts==opts.worldType && block->colormap==gColormap)
-    {
-		if (block->rendermissing // wait, the last render was incomplete
-			&& Cache_Find(bx, bz+block->rendermissing) != NULL) {
-				; // we can do a better render now that the missing block is loaded
-		} else {
-			// Yes, it's been rendered, but now we need to check if the highlight number is OK:
-			// If the area is inside the highlighted region, renderhilitID==gHighlightID.
-			// If the area is outside the hightlighted region, renderhilitID==0.
-			// Else the area should be redrawn.
-			// final check, is highlighting state OK?
-			if ( ((block->renderhilitID==gHighlightID) && isInside) ||
-				((block->renderhilitID==0) && !isInside) )
-			{
-                // there's no need to re-render, use cached image already generated
-                return block->rendercache;
-            }
-			// else re-render, to clean up previous highlight
-        }
+//copy block to bits at px,py at zoom.  bits is wxh
+static void blit(unsigned char *block,unsigned char *bits,int px,int py,
+    const BlitScale *scale,int w,int h)
+{
+    int y,x0,x1,y0,y1;
+    unsigned char *row,*prevRow=NULL;
+
+    // clip to the map
+    x0=max(0,-px);
+    x1=min(scale->size,w-px);
+    y0=max(0,-py);
+    y1=min(scale->size,h-py);
+    if (x0>=x1 || y0>=y1)
+        return;
+
+    bits+=(py*w+px)*4;
+    for (y=y0;y<y1;y++)
+    {
+        row=bits+y*w*4;
+        // zoomed in, rows repeat: copy the one above
+        if (prevRow!=NULL && scale->src[y]==scale->src[y-1])
+            memcpy(row+x0*4,prevRow+x0*4,(x1-x0)*4);
+        else
+            scaleRow((const unsigned int *)(block+(scale->src[y]<<6)),(unsigned int *)row,scale,x0,x1);
+        prevRow=row;
     }
+}
 
-    block->rendery=maxHeight;
-    block->renderopts=opts.worldType;
-	// if the block to be drawn is inside, note the ID, else note it's "clean" of highlighting;
-	// when we come back next time, the code above will note the rendering is OK.
-    block->renderhilitID= isInside ? gHighlightID : 0;
-    block->rendermissing=0;
-    block->colormap=gColormap;
+void CloseAll()
+{
+    int i;
 
-    bits = block->rendercache;
+    DrawMapCancel();
+    Cache_Empty();
+    regionCloseAll();
+    free(gPyramid);
+    gPyramid=NULL;
+    for (i = 0; i < MAX_WORKER_THREADS; i++)
+    {
+        if (gLoadDecoders[i] != NULL)
+        {
+            freeChunkDecoder(gLoadDecoders[i]);
+            gLoadDecoders[i] = NULL;
+        }
+    }
+}
 
-    // find the block to the west, so we can use its heightmap for shading
-    prevblock=(WorldBlock *)Cache_Find(bx-1, bz);
+// the highest y at or below the given one with a block in the column, from its
+// columnBits, or -1 if it's all air down to the bottom
+static int blockAtOrBelow(const unsigned int *bits,int y)
+{
+    int word=y>>5;
+    unsigned int mask=bits[word]&(0xffffffffu>>(31-(y&31)));
+#ifdef _MSC_VER
+    unsigned long index;
+#endif
 
-    if (prevblock==NULL)
-        block->rendermissing=1; //note no loaded block to west
-    else if (prevblock->rendery!=maxHeight || prevblock->renderopts!=opts.worldType) {
-        block->rendermissing=1; //note improperly rendered block to west
-        prevblock = NULL; //block was rendered at a different y level, ignore
+    while (mask==0)
+    {
+        if (--word<0)
+            return -1;
+        mask=bits[word];
     }
+#ifdef _MSC_VER
+    _BitScanReverse(&index,mask);
+    return word*32+(int)index;
+#else
+    return word*32+31-__builtin_clz(mask);
+#endif
+}
+
+// Draw the columns of a block into its rendercache and heightmap. There's a kernel
+// for each set of the options tested per voxel, so they aren't tested in the loops.
+// Colors are premultiplied, and blended with alphas out of 256.
+template <bool cavemode, bool showobscured, bool depthshading, bool lighting, bool highlight>
+static void drawKernel(WorldBlock *block,WorldBlock *prevblock,int bx,int bz,int maxHeight,unsigned int viewFilterFlags,int *hitsFound)
+{
+    int ofs=0,prevy,bofs,prevSely,blockAlpha,light;
+    //int hasSlime = 0;
+    int x,z,i,below,skip,alpha,blend;
+    unsigned short sections;
+    unsigned int color;
+    unsigned char voxel, r, g, b, seenempty;
+    unsigned char *bits=block->rendercache;
+
     // x increases south, decreases north
 	for (z=0;z<16;z++)
     {
@@ -508,10 +1301,33 @@ static unsigned char* draw(const wchar_t *world,int bx,int bz,int maxHeight,Opti
             // the next solid block is then shown. If it's solid all the way down, the block will be
             // drawn as "empty"
             seenempty=(maxHeight==MAP_MAX_HEIGHT?1:0);
-            alpha=0.0;
+            alpha=0;
+            // skip straight past the air above the column's highest block
+            sections=block->columnMask[x+z*16];
+            i=block->top[x+z*16];
+            if (i<maxHeight)
+            {
+                bofs-=(maxHeight-i)*16*16;
+                seenempty=1;
+            }
+            else
+            {
+                i=maxHeight;
+            }
             // go from top down through all voxels, looking for the first one visible.
-			for (i=maxHeight;i>=0;i--,bofs-=16*16)
+			for (;i>=0;i--,bofs-=16*16)
             {
+                // drop straight through any air, or blocks the map never shows, to
+                // the next block down; they'd be skipped just the same below
+                below=blockAtOrBelow(block->columnBits[x+z*16],i);
+                if (below!=i)
+                {
+                    seenempty=1;
+                    bofs-=(i-below)*16*16;
+                    i=below;
+                    if (i<0)
+                        break;
+                }
                 voxel=block->grid[bofs];
                 // if block is air or something very small, note it's empty and continue to next voxel
                 if ( (voxel==BLOCK_AIR) ||
@@ -521,11 +1337,12 @@ static unsigned char* draw(const wchar_t *world,int bx,int bz,int maxHeight,Opti
                     continue;
                 }
 
+                // 0 for unknown IDs and for blocks that are entirely transparent
+                blockAlpha=gBlockAlpha[voxel];
+
                 // special selection height: we want to be able to select water
-                blockSolid = voxel<NUM_BLOCKS && gBlockDefinitions[voxel].alpha!=0.0;
-                if ((showobscured || seenempty) && blockSolid)
-                    if (prevSely==-1) 
-                        prevSely=i;
+                if (highlight && (showobscured || seenempty) && blockAlpha && prevSely==-1)
+                    prevSely=i;
 
                 // non-flowing water does not count when finding the displayed height, so that we can reveal what is
                 // underneath the water.
@@ -535,20 +1352,15 @@ static unsigned char* draw(const wchar_t *world,int bx,int bz,int maxHeight,Opti
                 // if showobscured is on, or voxel is air or water (seenempty)
                 // AND the voxel id is valid (in our array of known values)
                 // AND it's not entirely transparent, then process it
-                if ((showobscured || seenempty) && blockSolid)
+                if ((showobscured || seenempty) && blockAlpha)
                 {
-                    int light=12;
+                    light=12;
                     if (lighting)
                     {
 						if (i < MAP_MAX_HEIGHT)
-                        {
-							light=block->light[bofs/2];
-							if (bofs&1) light>>=4;
-                            light&=0xf;
-                        } else
-                        {
-                            light = 0;
-                        }
+                            light=(block->light[bofs/2]>>((bofs&1)*4))&0xf;
+                        else
+                            light=0;
                     }
                     // if it's the first voxel visible, note this depth.
                     if (prevy==-1) 
@@ -559,19 +1371,19 @@ static unsigned char* draw(const wchar_t *world,int bx,int bz,int maxHeight,Opti
                         light-=5;
                     light=clamp(light,1,15);
                     color=gBlockColors[voxel*16+light];
-                    if (alpha==0.0)
+                    if (alpha==0)
                     {
-                        alpha=gBlockDefinitions[voxel].alpha;
+                        alpha=blockAlpha;
                         r=(unsigned char)(color>>16);
                         g=(unsigned char)((color>>8)&0xff);
                         b=(unsigned char)(color&0xff);
                     }
                     else
                     {
-                        r+=(unsigned char)((1.0-alpha)*(color>>16));
-                        g+=(unsigned char)((1.0-alpha)*((color>>8)&0xff));
-                        b+=(unsigned char)((1.0-alpha)*(color&0xff));
-                        alpha+=gBlockDefinitions[voxel].alpha*(1.0-alpha);
+                        r+=(unsigned char)(((256-alpha)*(color>>16))>>8);
+                        g+=(unsigned char)(((256-alpha)*((color>>8)&0xff))>>8);
+                        b+=(unsigned char)(((256-alpha)*(color&0xff))>>8);
+                        alpha+=(blockAlpha*(256-alpha))>>8;
                     }
                     // if the block is solid and something we want visible, break out of the loop, we're done
                     if ((gBlockDefinitions[voxel].flags & BLF_HIDE_ON_MAP) == 0x0)
@@ -603,7 +1415,7 @@ static unsigned char* draw(const wchar_t *world,int bx,int bz,int maxHeight,Opti
             //    }
             //}
 
-            if (cavemode)
+            if (cavemode && i >= 0) // i is -1 if the column is empty
             {
                 seenempty=0;
                 voxel=block->grid[bofs];
@@ -615,13 +1427,22 @@ static unsigned char* draw(const wchar_t *world,int bx,int bz,int maxHeight,Opti
 
 				for (;i>=1;i--,bofs-=16*16)
                 {
+                    if (!(sections&(1<<(i>>4))))
+                    {
+                        // all air down to the section's bottom, or to y 1
+                        seenempty=1;
+                        skip=(i&0xf)<i-1 ? (i&0xf) : i-1;
+                        bofs-=skip*16*16;
+                        i-=skip;
+                        continue;
+                    }
                     voxel=block->grid[bofs];
                     if (voxel==BLOCK_AIR)
                     {
                         seenempty=1;
                         continue;
                     }
-                    if (seenempty && voxel<NUM_BLOCKS && gBlockDefinitions[voxel].alpha!=0.0)
+                    if (seenempty && gBlockAlpha[voxel])
                     {
                         r=(unsigned char)(r*(prevy-i+10)/138);
                         g=(unsigned char)(g*(prevy-i+10)/138);
@@ -631,7 +1452,7 @@ static unsigned char* draw(const wchar_t *world,int bx,int bz,int maxHeight,Opti
                 }
             }
 
-            if ( gBoxHighlightUsed ) {
+            if ( highlight ) {
                 // make selected area slightly red, if at right heightmap range
                 if ( bx*16 + x >= gBoxMinX && bx*16 + x <= gBoxMaxX &&
                      bz*16 + z >= gBoxMinZ && bz*16 + z <= gBoxMaxZ )
@@ -647,29 +1468,28 @@ static unsigned char* draw(const wchar_t *world,int bx,int bz,int maxHeight,Opti
                     {
                         hitsFound[1] = 1;
                         // blend in highlight color
-                        blend = gHalpha;
+                        blend = (int)(gHalpha*256);
                         // are we on a border? If so, change blend factor
                         if ( prevSely == gBoxMinY || prevSely == gBoxMaxY ||
                             bx*16 + x == gBoxMinX || bx*16 + x == gBoxMaxX ||
                             bz*16 + z == gBoxMinZ || bz*16 + z == gBoxMaxZ )
                         {
-                            blend = gHalphaBorder;
+                            blend = (int)(gHalphaBorder*256);
                         }
-                        r = (unsigned char)((double)r*(1.0-blend) + blend*(double)gHred);
-                        g = (unsigned char)((double)g*(1.0-blend) + blend*(double)gHgreen);
-                        b = (unsigned char)((double)b*(1.0-blend) + blend*(double)gHblue);
+                        r = (unsigned char)((r*(256-blend) + blend*gHred)>>8);
+                        g = (unsigned char)((g*(256-blend) + blend*gHgreen)>>8);
+                        b = (unsigned char)((b*(256-blend) + blend*gHblue)>>8);
                     }
                     else if ( prevSely < gBoxMinY )
                     {
                         hitsFound[0] = 1;
-                        // lower than selection box, so if exactly on border, dim
+                        // lower than selection box, so if exactly on border, dim by half
                         if ( bx*16 + x == gBoxMinX || bx*16 + x == gBoxMaxX ||
                             bz*16 + z == gBoxMinZ || bz*16 + z == gBoxMaxZ )
                         {
-                            double dim=0.5;
-                            r = (unsigned char)((double)r*dim);
-                            g = (unsigned char)((double)g*dim);
-                            b = (unsigned char)((double)b*dim);
+                            r >>= 1;
+                            g >>= 1;
+                            b >>= 1;
                         }
                     }
                     else
@@ -682,10 +1502,9 @@ static unsigned char* draw(const wchar_t *world,int bx,int bz,int maxHeight,Opti
                         if ( bx*16 + x == gBoxMinX || bx*16 + x == gBoxMaxX ||
                             bz*16 + z == gBoxMinZ || bz*16 + z == gBoxMaxZ )
                         {
-                            double brighten=0.5;
-                            r = (unsigned char)((double)r*(1.0-brighten) + brighten);
-                            g = (unsigned char)((double)g*(1.0-brighten) + brighten);
-                            b = (unsigned char)((double)b*(1.0-brighten) + brighten);
+                            r = (unsigned char)((r+1)>>1);
+                            g = (unsigned char)((g+1)>>1);
+                            b = (unsigned char)((b+1)>>1);
                         }
                     }
                 }
@@ -699,7 +1518,98 @@ static unsigned char* draw(const wchar_t *world,int bx,int bz,int maxHeight,Opti
             block->heightmap[x+z*16] = (unsigned char)prevy;
         }
     }
-    return bits;
+}
+
+// the four kernels for cavemode and showobscured, with the other options given
+#define DRAW_KERNELS(highlight,lighting,depthshading) \
+    drawKernel<false,false,depthshading,lighting,highlight>, \
+    drawKernel<true,false,depthshading,lighting,highlight>, \
+    drawKernel<false,true,depthshading,lighting,highlight>, \
+    drawKernel<true,true,depthshading,lighting,highlight>
+
+// indexed by drawKernelFor()
+static const DrawKernel gDrawKernels[32]={
+    DRAW_KERNELS(false,false,false), DRAW_KERNELS(false,false,true),
+    DRAW_KERNELS(false,true,false), DRAW_KERNELS(false,true,true),
+    DRAW_KERNELS(true,false,false), DRAW_KERNELS(true,false,true),
+    DRAW_KERNELS(true,true,false), DRAW_KERNELS(true,true,true)
+};
+
+// the kernel for the options, and the highlight as it is now
+static DrawKernel drawKernelFor(Options opts)
+{
+    int index=((opts.worldType&CAVEMODE) ? 1 : 0) |
+        ((opts.worldType&HIDEOBSCURED) ? 0 : 2) |
+        ((opts.worldType&DEPTHSHADING) ? 4 : 0) |
+        ((opts.worldType&LIGHTING) ? 8 : 0) |
+        (gBoxHighlightUsed ? 16 : 0);
+    return gDrawKernels[index];
+}
+
+// Draw a block at chunk bx,bz, as rows says to draw.
+// returns 16x16 set of block colors to use to render map.
+// colors are adjusted by height, transparency, etc.
+// render a block, or a blank tile if it hasn't been read in
+static unsigned char* draw(const DrawRows *rows,WorldBlock *block,int bx,int bz,int *hitsFound)
+{
+    WorldBlock *prevblock;
+    int maxHeight=rows->y;
+    int worldType=rows->opts.worldType;
+
+//    if ((opts.worldType&(HELL|ENDER|SLIME))==SLIME)
+//            hasSlime = isSlimeChunk(bx, bz);
+
+    // a block that couldn't be read again with all the request asks for is left out too
+    if (block==NULL || !BLOCK_HAS(block,&rows->request)) //blank tile
+        return gBlankTile;
+
+	// At this point the block is loaded.
+
+	// Is it inside highlighted area?
+	bool isInside = ( bx >= gDirtyBoxMinX-1 && bx <= gDirtyBoxMaxX &&
+		bz >= gDirtyBoxMinZ-1 && bz <= gDirtyBoxMaxZ );
+
+	// already rendered?
+    if (block->rendery==maxHeight && block->renderopts==worldType && block->colormap==gColormap)
+    {
+		if (block->rendermissing // wait, the last render was incomplete
+			&& Cache_Peek(bx, bz+block->rendermissing) != NULL) {
+				; // we can do a better render now that the missing block is loaded
+		} else {
+			// Yes, it's been rendered, but now we need to check if the highlight number is OK:
+			// If the area is inside the highlighted region, renderhilitID==gHighlightID.
+			// If the area is outside the hightlighted region, renderhilitID==0.
+			// Else the area should be redrawn.
+			// final check, is highlighting state OK?
+			if ( ((block->renderhilitID==gHighlightID) && isInside) ||
+				((block->renderhilitID==0) && !isInside) )
+			{
+                // there's no need to re-render, use cached image already generated
+                return block->rendercache;
+            }
+			// else re-render, to clean up previous highlight
+        }
+    }
+
+    block->rendery=maxHeight;
+    block->renderopts=worldType;
+	// if the block to be drawn is inside, note the ID, else note it's "clean" of highlighting;
+	// when we come back next time, the code above will note the rendering is OK.
+    block->renderhilitID= isInside ? gHighlightID : 0;
+    block->rendermissing=0;
+    block->colormap=gColormap;
+
+    // find the block to the west, so we can use its heightmap for shading
+    prevblock=(WorldBlock *)Cache_Peek(bx-1, bz);
+
+    if (prevblock==NULL)
+        block->rendermissing=1; //note no loaded block to west
+    else if (prevblock->rendery!=maxHeight || prevblock->renderopts!=worldType) {
+        block->rendermissing=1; //note improperly rendered block to west
+        prevblock = NULL; //block was rendered at a different y level, ignore
+    }
+    rows->kernel(block,prevblock,bx,bz,maxHeight,rows->viewFilterFlags,hitsFound);
+    return block->rendercache;
 }
 
 #define BLOCK_INDEX(x,y,z) (  ((y)*256)+ \
@@ -1753,7 +2663,204 @@ void testNumeral( WorldBlock *block, int type, int y, int digitPlace, int outTyp
 }
 
 
-WorldBlock *LoadBlock(wchar_t *directory, int cx, int cz)
+// Major change: convert all wool found into colored wool. It's much easier
+// to simply change to a new block type, colored wool, than put special-case
+// code throughout the program. If you don't like colored wool (it costs a
+// little speed to process the wool), take it out of gDataRemaps. You'll also
+// have to change numBlocks = numBlocksStandard.
+
+// block IDs that become one of 16 new IDs, one per data value
+typedef struct DataRemap {
+    unsigned char id;       // the block ID as read
+    unsigned char first;    // the new ID for data value 0
+} DataRemap;
+
+// Only wool has an ID per color. Stained clay and carpets keep their one ID, and the
+// export colors them by data value; remapping them would need their own run of IDs,
+// block definitions and tiles after the wool's, not just an entry here.
+static const DataRemap gDataRemaps[] = {
+    { BLOCK_WOOL, NUM_BLOCKS_STANDARD },
+};
+#define NUM_DATA_REMAPS (int)(sizeof(gDataRemaps)/sizeof(gDataRemaps[0]))
+
+// what each ID read becomes; if gRemapByData is set for an ID, it instead becomes
+// that value plus the block's data value
+static unsigned char gRemapID[256];
+static unsigned char gRemapByData[256];
+
+static int initBlockRemap()
+{
+    int i;
+    for ( i = 0; i < 256; i++ )
+    {
+        // some new version of Minecraft, block ID is unrecognized;
+        // turn this block into stone. dataVal will be ignored.
+        gRemapID[i] = (unsigned char)(( i < NUM_BLOCKS_STANDARD ) ? i : BLOCK_UNKNOWN);
+        gRemapByData[i] = 0;
+    }
+    for ( i = 0; i < NUM_DATA_REMAPS; i++ )
+        gRemapByData[gDataRemaps[i].id] = gDataRemaps[i].first;
+    return 1;
+}
+// built before any thread can load a block
+static int gRemapInited = initBlockRemap();
+
+// 1 for the IDs the map may show, with SHOWALL or not: see findOccupancy()
+static unsigned char gMapShown[256];
+
+static int initMapShown()
+{
+    int i;
+    for ( i = 0; i < 256; i++ )
+        gMapShown[i] = (unsigned char)(( gBlockDefinitions[i].flags & (MAP_VIEW_FLAGS|MAP_SHOWALL_FLAGS) ) != 0);
+    return 1;
+}
+static int gMapShownInited = initMapShown();
+
+// remap count IDs starting at index i of the block; 1 if any were unknown
+static int remapIDs(WorldBlock *block, int i, int count)
+{
+    int id, dataVal, unknown = 0;
+    for ( ; count > 0; count--, i++ )
+    {
+        id = block->grid[i];
+        if ( gRemapByData[id] )
+        {
+            dataVal = block->data[i/2];
+            if ( i & 0x01 )
+                dataVal = dataVal >> 4;
+            else
+                dataVal &= 0xf;
+            block->grid[i] = (unsigned char)(gRemapByData[id] + dataVal);
+        }
+        else
+        {
+            block->grid[i] = gRemapID[id];
+            unknown |= ( id >= NUM_BLOCKS_STANDARD );
+        }
+    }
+    return unknown;
+}
+
+// Only a few IDs change, so look for them 16 at a time and leave the rest alone.
+// returns 1 if any IDs were unknown; blocks are converted on the worker threads, so
+// it's up to the caller to pass that on to noteUnknownBlock() on the main thread.
+static int convertBlockIDs(WorldBlock *block, const DecodeRequest *request)
+{
+    int i, end, unknown = 0;
+#ifdef REMAP_SSE2
+    int r;
+    __m128i ids, hits;
+    __m128i lastKnown = _mm_set1_epi8((char)(NUM_BLOCKS_STANDARD-1));
+    __m128i dataIDs[NUM_DATA_REMAPS];
+    for ( r = 0; r < NUM_DATA_REMAPS; r++ )
+        dataIDs[r] = _mm_set1_epi8((char)gDataRemaps[r].id);
+#endif
+
+    // the sections not read are all air
+    i = request->minSection*16*16*16;
+    end = (request->maxSection+1)*16*16*16;
+#ifdef REMAP_SSE2
+    for ( ; i < end; i += 16 )
+    {
+        // IDs past the last known one, as unsigned bytes
+        ids = _mm_loadu_si128((const __m128i *)&block->grid[i]);
+        hits = _mm_xor_si128(_mm_cmpeq_epi8(_mm_min_epu8(ids, lastKnown), ids), _mm_set1_epi8(-1));
+        for ( r = 0; r < NUM_DATA_REMAPS; r++ )
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(ids, dataIDs[r]));
+        if ( _mm_movemask_epi8(hits) )
+            unknown |= remapIDs(block, i, 16);
+    }
+#else
+    unknown = remapIDs(block, i, end-i);
+#endif
+
+    return unknown;
+}
+
+// a block with unknown IDs was read. Main thread only.
+static void noteUnknownBlock()
+{
+    // flag assert only once
+    assert( (gUnknownBlock == 1 ) || (gPerformUnknownBlockCheck == 0) );	// note the program needs fixing
+    // note that we always clean up bad blocks;
+    // whether we flag that a bad block was found is optional.
+    // This gets turned off once the user has been warned, once, that his map has some funky data.
+    if ( gPerformUnknownBlockCheck )
+        gUnknownBlock = 1;
+}
+
+// note which sections of the chunk have anything in them, and the highest non-air
+// block in each column, or -1 if there is none. columnBits, which the draw kernels
+// drop through, marks only the heights with a block the map can show: the one view
+// filter that never shows a block is the widest, with SHOWALL. Without SHOWALL, the
+// few small blocks it adds are still stepped over one at a time. Cave mode's second
+// pass looks for any non-air block, so uses columnMask, not these.
+static void findOccupancy(WorldBlock *block)
+{
+    int section, y, i, occupied;
+    unsigned short bit;
+    unsigned int ybit;
+    unsigned char *layer, *data;
+
+    memset(block->columnMask, 0, sizeof(block->columnMask));
+    memset(block->columnBits, 0, sizeof(block->columnBits));
+    block->sectionMask = 0;
+    for (section = 0; section < 16; section++)
+    {
+        bit = (unsigned short)(1 << section);
+        occupied = 0;
+        for (y = section*16; y < section*16+16; y++)
+        {
+            layer = &block->grid[y*16*16];
+            ybit = 1u << (y&31);
+            for (i = 0; i < 16*16; i++)
+            {
+                if (layer[i] != BLOCK_AIR)
+                {
+                    if (gMapShown[layer[i]])
+                        block->columnBits[i][y>>5] |= ybit;
+                    block->columnMask[i] |= bit;
+                    occupied = 1;
+                }
+            }
+        }
+        if (!occupied)
+        {
+            // air can have a data value, too
+            data = &block->data[section*16*16*8];
+            for (i = 0; i < 16*16*8 && data[i] == 0; i++)
+                ;
+            occupied = (i < 16*16*8);
+        }
+        if (occupied)
+            block->sectionMask |= bit;
+    }
+
+    // each column's top is in its highest occupied section
+    for (i = 0; i < 16*16; i++)
+    {
+        block->top[i] = -1;
+        if (block->columnMask[i] == 0)
+            continue;
+        for (section = 15; !(block->columnMask[i] & (1 << section)); section--)
+            ;
+        for (y = section*16+15; block->grid[y*16*16+i] == BLOCK_AIR; y--)
+            ;
+        block->top[i] = (short)y;
+    }
+}
+// returns 1 if the block had unknown IDs, as for convertBlockIDs()
+static int finishBlock(WorldBlock *block, const DecodeRequest *request)
+{
+    int unknown = convertBlockIDs(block, request);
+    findOccupancy(block);
+    block->decoded = *request;
+    return unknown;
+}
+
+// allocate a block to load into
+static WorldBlock *newBlock()
 {
     WorldBlock *block=block_alloc();
 
@@ -1762,8 +2869,18 @@ WorldBlock *LoadBlock(wchar_t *directory, int cx, int cz)
 	{
 		Cache_Empty();
 		block=block_alloc();
+		if ( block == NULL )
+			return NULL;
 	}
     block->rendery = -1; // force redraw
+    return block;
+}
+
+// fill in a freshly allocated block with as much of chunk cx,cz as is requested.
+// *unknown is set to 1 if the chunk has block IDs we don't know, else left alone.
+// returns 1 on success, 0 if the chunk doesn't exist or can't be read
+static int fillBlock(ChunkDecoder *decoder, WorldBlock *block, wchar_t *directory, int cx, int cz, const DecodeRequest *request, int *unknown)
+{
 
 	if ( directory[0] == (wchar_t)'/' )
 	{
@@ -1778,6 +2895,9 @@ WorldBlock *LoadBlock(wchar_t *directory, int cx, int cz)
 		memset(block->data, 0, 16*16*128);
 		memset(block->light, 0xff, 16*16*128);
 		block->renderhilitID = 0;
+		block->decoded.channels = DECODE_ALL;
+		block->decoded.minSection = 0;
+		block->decoded.maxSection = 15;
 
 		if ( type >= 0 && type < NUM_BLOCKS && cz >= 0 && cz < 8)
 		{
@@ -1798,7 +2918,8 @@ WorldBlock *LoadBlock(wchar_t *directory, int cx, int cz)
 				testBlock(block,type+1,blockHeight,cz*2);
 				testBlock(block,type+1,blockHeight,cz*2+1);
 			}
-			return block;
+			findOccupancy(block);
+			return 1;
 		}
         // tick marks
         else if ( type >= 0 && type < NUM_BLOCKS && (cz == -1 || cz == 8) )
@@ -1826,7 +2947,8 @@ WorldBlock *LoadBlock(wchar_t *directory, int cx, int cz)
                     }
                 }
             }
-            return block;
+            findOccupancy(block);
+            return 1;
         }
         // numbers (yes, I'm insane)
         else if ( type >= 0 && type < NUM_BLOCKS && (cz <= -2 && cz >= -3) )
@@ -1871,60 +2993,276 @@ WorldBlock *LoadBlock(wchar_t *directory, int cx, int cz)
                 testNumeral(block,type+1,blockHeight,-cz*2-3, letterType);
                 testNumeral(block,type+1,blockHeight,-cz*2-1-3, letterType);
             }
-            return block;
+            findOccupancy(block);
+            return 1;
         }
 		else
 		{
-			block_free(block);
-			return NULL;
+			return 0;
 		}
 	}
 	// end of test world, resume normal programming
 
-    if (regionGetBlocks(directory, cx, cz, block->grid, block->data, block->light)) {
+    if (regionGetBlocksR(decoder, directory, cx, cz, block->grid, block->data, block->light, request)) {
         // got block successfully
-        // Major change: convert all wool found into colored wool. It's much easier
-        // to simply change to a new block type, colored wool, than put special-case
-        // code throughout the program. If you don't like colored wool (it costs a
-        // little speed to process the wool), comment out this piece. You'll also
-        // have to change numBlocks = numBlocksStandard.
-		// TODO: someday add tinted clay and carpets
-        //if ( convertToColoredWool )
-        //{
-            int i;
-            unsigned char *pBlockID = block->grid;
-            for ( i = 0; i < 16*16*256; i++, pBlockID++ )
+        if (finishBlock(block, request))
+            *unknown = 1;
+        return 1;
+    }
+
+    return 0;
+}
+
+WorldBlock *LoadBlock(wchar_t *directory, int cx, int cz, const DecodeRequest *request)
+{
+    WorldBlock *block;
+    int unknown = 0;
+
+    // don't bother with a block for chunks known not to exist
+    if ( directory[0] != (wchar_t)'/' && !regionChunkExists(directory, cx, cz) )
+        return NULL;
+
+    block=newBlock();
+
+    if (block == NULL)
+        return NULL;
+    if (!fillBlock(NULL, block, directory, cx, cz, request, &unknown))
+    {
+        block_free(block);
+        return NULL;
+    }
+    if (unknown)
+        noteUnknownBlock();
+    return block;
+}
+
+// reentrant version of LoadBlock: any number of threads can load blocks at
+// once, each with its own decoder. Does not touch the cache. *unknownFound is
+// set to 1 if the chunk has block IDs we don't know, else left alone; this
+// doesn't flag it for UnknownBlockRead(), as LoadBlock does.
+WorldBlock *LoadBlockR(ChunkDecoder *decoder, wchar_t *directory, int cx, int cz, const DecodeRequest *request, int *unknownFound)
+{
+    WorldBlock *block;
+
+    if ( directory[0] != (wchar_t)'/' && !regionChunkExists(directory, cx, cz) )
+        return NULL;
+
+    block=block_alloc();
+
+    if (block == NULL)
+        return NULL;
+    block->rendery = -1; // force redraw
+
+    if (!fillBlock(decoder, block, directory, cx, cz, request, unknownFound))
+    {
+        block_free(block);
+        return NULL;
+    }
+    return block;
+}
+
+// chunks decoded by one RunParallel() call; each gets its own block, so this bounds
+// the memory a LoadBlocks() call has in flight beyond the cache
+#define LOAD_SLICE 64
+
+typedef struct LoadBlocksData {
+    const DecodeRequest *request;
+    LoadBlockCallback callback;
+    void *userData;
+    RegionChunk *chunks;    // the slice being decoded
+    ChunkCoord unpacked[LOAD_SLICE];    // or the chunks the cache had packed
+    WorldBlock *blocks[LOAD_SLICE];
+    int state[LOAD_SLICE];  // LOAD_*
+    int unknown[MAX_WORKER_THREADS];    // set if a thread read unknown block IDs
+} LoadBlocksData;
+
+#define LOAD_FAILED 0
+#define LOAD_RELEASE 1
+#define LOAD_KEEP 2
+#define LOAD_RETRY 3
+
+static void decodeChunkJob(int index, int thread, void *userData)
+{
+    LoadBlocksData *lbd = (LoadBlocksData *)userData;
+    RegionChunk *chunk = &lbd->chunks[index];
+    WorldBlock *block = lbd->blocks[index];
+
+    if (block == NULL)
+    {
+        lbd->state[index] = LOAD_FAILED;
+        return;
+    }
+    if (gLoadDecoders[thread] == NULL)
+    {
+        gLoadDecoders[thread] = newChunkDecoder();
+        if (gLoadDecoders[thread] == NULL)
+        {
+            // out of memory; the main thread will try again with its own decoder
+            lbd->state[index] = LOAD_RETRY;
+            return;
+        }
+    }
+
+    if (regionDecodeChunk(gLoadDecoders[thread], chunk, block->grid, block->data, block->light, lbd->request))
+    {
+        if (finishBlock(block, lbd->request))
+            lbd->unknown[thread] = 1;
+        lbd->state[index] = lbd->callback(chunk->cx, chunk->cz, block, thread, lbd->userData) ? LOAD_KEEP : LOAD_RELEASE;
+    }
+    else
+    {
+        lbd->state[index] = LOAD_FAILED;
+    }
+}
+
+// pass on what the threads found to the flag UnknownBlockRead() reports
+static void noteUnknownBlocks(LoadBlocksData *lbd)
+{
+    int i;
+
+    for (i = 0; i < MAX_WORKER_THREADS; i++)
+    {
+        if (lbd->unknown[i])
+        {
+            noteUnknownBlock();
+            lbd->unknown[i] = 0;
+        }
+    }
+}
+
+static void unpackedChunkJob(int index, int thread, void *userData)
+{
+    LoadBlocksData *lbd = (LoadBlocksData *)userData;
+
+    lbd->state[index] = lbd->callback(lbd->unpacked[index].cx, lbd->unpacked[index].cz, lbd->blocks[index], thread, lbd->userData) ? LOAD_KEEP : LOAD_RELEASE;
+}
+
+static void finishUnpackedChunks(LoadBlocksData *lbd, int n)
+{
+    int i;
+
+    RunParallel(n, unpackedChunkJob, lbd);
+    for (i = 0; i < n; i++)
+    {
+        if (lbd->state[i] == LOAD_KEEP)
+            Cache_Add(lbd->unpacked[i].cx, lbd->unpacked[i].cz, lbd->blocks[i]);
+        else
+            block_free(lbd->blocks[i]);
+    }
+}
+
+// Hand chunks the cache holds packed to the callback, rather than reading them again.
+// The coords left to read are moved to the front; returns how many there are.
+static int loadPackedChunks(LoadBlocksData *lbd, ChunkCoord *coords, int count)
+{
+    WorldBlock *block = NULL;
+    int i, n = 0, left = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        if (block == NULL)
+            block = newBlock();
+        // a packed block lacking what is requested is read again
+        if (block != NULL && Cache_Unpack(coords[i].cx, coords[i].cz, block) && BLOCK_HAS(block, lbd->request))
+        {
+            lbd->unpacked[n] = coords[i];
+            lbd->blocks[n++] = block;
+            block = NULL;
+            if (n == LOAD_SLICE)
+            {
+                finishUnpackedChunks(lbd, n);
+                n = 0;
+            }
+        }
+        else
+        {
+            coords[left++] = coords[i];
+        }
+    }
+    if (n > 0)
+        finishUnpackedChunks(lbd, n);
+    block_free(block);
+    return left;
+}
+
+static void loadRegionChunks(RegionChunk *chunks, int count, void *userData)
+{
+    LoadBlocksData *lbd = (LoadBlocksData *)userData;
+    int start, n, i;
+
+    for (start = 0; start < count; start += LOAD_SLICE)
+    {
+        n = min(count - start, LOAD_SLICE);
+
+        // allocate here, where the cache can be emptied if memory runs out
+        for (i = 0; i < n; i++)
+            lbd->blocks[i] = newBlock();
+
+        lbd->chunks = &chunks[start];
+        RunParallel(n, decodeChunkJob, lbd);
+        noteUnknownBlocks(lbd);
+
+        for (i = 0; i < n; i++)
+        {
+            WorldBlock *block = lbd->blocks[i];
+            if (lbd->state[i] == LOAD_RETRY)
             {
-                if ( *pBlockID == BLOCK_WOOL)
+                if (regionDecodeChunk(NULL, &lbd->chunks[i], block->grid, block->data, block->light, lbd->request))
                 {
-                    // convert to new block
-                    int woolVal = block->data[i/2];
-                    if ( i & 0x01 )
-                        woolVal = woolVal >> 4;
-                    else
-                        woolVal &= 0xf;
-                    *pBlockID = (unsigned char)(NUM_BLOCKS_STANDARD + woolVal);
+                    if (finishBlock(block, lbd->request))
+                        noteUnknownBlock();
+                    lbd->state[i] = lbd->callback(lbd->chunks[i].cx, lbd->chunks[i].cz, block, 0, lbd->userData) ? LOAD_KEEP : LOAD_RELEASE;
+                }
+                else
+                {
+                    lbd->state[i] = LOAD_FAILED;
                 }
-				else if ( *pBlockID >= NUM_BLOCKS_STANDARD )
-				{
-					// some new version of Minecraft, block ID is unrecognized;
-					// turn this block into stone. dataVal will be ignored.
-					// flag assert only once
-					assert( (gUnknownBlock == 1 ) || (*pBlockID < NUM_BLOCKS_STANDARD) || (gPerformUnknownBlockCheck == 0) );	// note the program needs fixing
-					*pBlockID = BLOCK_UNKNOWN;
-					// note that we always clean up bad blocks;
-					// whether we flag that a bad block was found is optional.
-					// This gets turned off once the user has been warned, once, that his map has some funky data.
-					if ( gPerformUnknownBlockCheck )
-						gUnknownBlock = 1;
-				}
             }
-        //}
-        return block;
+
+            if (lbd->state[i] == LOAD_KEEP)
+                Cache_Add(lbd->chunks[i].cx, lbd->chunks[i].cz, block);
+            else if (block != NULL)
+                block_free(block);
+        }
     }
+}
 
-    block_free(block);
-    return NULL;
+// Load a set of chunks, reading each region file in on-disk order rather than
+// chunk by chunk, and decoding them on the worker threads. The callback sees chunks
+// in whatever order they are decoded, several at once; chunks that don't exist are
+// skipped, and chunks the cache has packed are unpacked rather than read. The request
+// says what to read of each chunk. The coords array is reordered.
+void LoadBlocks(wchar_t *directory, ChunkCoord *coords, int count, const DecodeRequest *request, LoadBlockCallback callback, void *userData)
+{
+    LoadBlocksData *lbd;
+    int i;
+
+	if ( directory[0] == (wchar_t)'/' )
+	{
+		// [Block Test World] is synthesized, nothing to read
+		for ( i = 0; i < count; i++ )
+		{
+			WorldBlock *block = LoadBlock(directory, coords[i].cx, coords[i].cz, request);
+			if ( block == NULL )
+				continue;
+			if ( callback(coords[i].cx, coords[i].cz, block, 0, userData) )
+				Cache_Add(coords[i].cx, coords[i].cz, block);
+			else
+				block_free(block);
+		}
+		return;
+	}
+
+    lbd = (LoadBlocksData *)malloc(sizeof(LoadBlocksData));
+    if (lbd == NULL)
+        return;
+    lbd->request = request;
+    lbd->callback = callback;
+    lbd->userData = userData;
+    memset(lbd->unknown, 0, sizeof(lbd->unknown));
+    count = loadPackedChunks(lbd, coords, count);
+    regionReadChunks(directory, coords, count, loadRegionChunks, lbd);
+    free(lbd);
 }
 
 // Clear that an unknown block was encountered. Good to do when loading a new world.
@@ -2078,6 +3416,8 @@ static void initColors()
             b=(unsigned int)clamp(y+1.770*u,0,255);
             gBlockColors[i*16+shade]=(r<<16)|(g<<8)|b;
         }
+        // anything at all visible keeps an alpha of at least 1
+        gBlockAlpha[i]=(gBlockDefinitions[i].alpha>0.0) ? max((int)(gBlockDefinitions[i].alpha*256+0.5f),1) : 0;
     }
 
 	// set the Empty color, for initialization
@@ -52,13 +52,24 @@ extern "C" {
 #define SHOWALL         0x80
 
 typedef void (*ProgressCallback)(float progress);
+// called by LoadBlocks for each chunk read. Calls come from several worker threads
+// at once, thread being the worker's number (see threads.h), so the callback must
+// not touch the cache. Return 1 to have the block added to the cache, 0 to release it.
+typedef int (*LoadBlockCallback)(int bx, int bz, WorldBlock *block, int thread, void *userData);
 
     __declspec(dllexport) void __cdecl SetHighlightState( int on, int minx, int miny, int minz, int maxx, int maxy, int maxz );
     __declspec(dllexport) void __cdecl GetHighlightState( int *on, int *minx, int *miny, int *minz, int *maxx, int *maxy, int *maxz );
     __declspec(dllexport) void __cdecl DrawMap(const wchar_t *world,double cx,double cz,int y,int w,int h,double zoom,unsigned char *bits, Options opts, int hitsFound[3], ProgressCallback callback);
+    // DrawMap a piece at a time: see MinewaysMap.cpp
+    __declspec(dllexport) int __cdecl DrawMapStart(const wchar_t *world,double cx,double cz,int y,int w,int h,double zoom,unsigned char *bits, Options opts, int hitsFound[3], ProgressCallback callback);
+    __declspec(dllexport) int __cdecl DrawMapStep(int maxChunks, int hitsFound[3], int rect[4]);
+    __declspec(dllexport) void __cdecl DrawMapCancel();
+    __declspec(dllexport) int __cdecl GetMapDrawnAreas(int areas[2][4]);
     __declspec(dllexport) const char * __cdecl IDBlock(int bx, int by, double cx, double cz, int w, int h, double zoom,int *ox,int *oy,int *oz,int *type);
     __declspec(dllexport) void __cdecl CloseAll();
-    __declspec(dllexport) WorldBlock * __cdecl LoadBlock(wchar_t *directory,int bx,int bz);
+    __declspec(dllexport) WorldBlock * __cdecl LoadBlock(wchar_t *directory,int bx,int bz,const DecodeRequest *request);
+    __declspec(dllexport) WorldBlock * __cdecl LoadBlockR(ChunkDecoder *decoder,wchar_t *directory,int bx,int bz,const DecodeRequest *request,int *unknownFound);
+    __declspec(dllexport) void __cdecl LoadBlocks(wchar_t *directory,ChunkCoord *coords,int count,const DecodeRequest *request,LoadBlockCallback callback,void *userData);
 	__declspec(dllexport) void __cdecl ClearBlockReadCheck();
 	__declspec(dllexport) int __cdecl UnknownBlockRead();
 	__declspec(dllexport) void __cdecl CheckUnknownBlock( int check );
@@ -40,6 +40,10 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define EXTRACT_SSE2
+#endif
 
 #include <vector>
 
@@ -96,6 +100,24 @@ static Point gFilledBoxSize;    // in centimeters
 static IBox gSolidWorldBox;  // area of solid box in world coordinates
 static IPoint gWorld2BoxOffset;
 
+#ifndef OLD_BUILD
+// What the first export pass keeps of each chunk, so that the second pass can fill
+// in gBoxData without reading and decoding the chunk again.
+typedef struct ChunkSummary {
+    int xmin, xmax, zmin, zmax;     // world columns of the chunk inside the export box
+    int ymin, ymax;                 // and its heights, the only ones kept
+    unsigned short sectionMask;     // bit n set if y 16n through 16n+15 has anything but plain air
+    unsigned char *slab;            // for each section in the mask, its rows in ymin..ymax:
+                                    // for each column, x major, the block IDs, then for each
+                                    // column the data values, two per byte. Freed once extracted.
+    int failed;                     // ran out of memory making the slab
+} ChunkSummary;
+
+// one summary per chunk of the export box, row by row in X
+static ChunkSummary *gChunkSummaries = NULL;
+static int gSummaryStartX, gSummaryStartZ, gSummaryNumX, gSummaryNumZ;
+#endif
+
 typedef struct FaceRecord {
     int type;	// block id
     int faceIndex;	// tie breaker, so that faces get near each other in location
@@ -506,11 +528,30 @@ static int initializeModelData();
 
 static int readTerrainPNG( const wchar_t *curDir, progimage_info *pII, wchar_t *terrainFileName );
 
+// what a chunk processor finds; each worker thread has its own, merged at the end
+typedef struct SweepResults {
+    IBox solidBox;      // bounds of solid blocks found, in world coordinates
+    int badBlocks;      // number of unknown blocks found
+} SweepResults;
+
+// what to do with each chunk overlapping the export box. Called from worker threads:
+// it may write only its own chunk's part of the box, and its results.
+typedef void (*ChunkProcessor)(WorldBlock *block, int bx, int bz, IBox *worldBox, SweepResults *results);
+
 static int populateBox(const wchar_t *world, IBox *box);
+static int sweepChunks(const wchar_t *world, IBox *worldBox, ChunkProcessor process);
+#ifndef OLD_BUILD
+static void findChunkBounds(WorldBlock *block, int bx, int bz, IBox *worldBox, SweepResults *results );
+#endif
+static void extractChunk(WorldBlock *block, int bx, int bz, IBox *box, SweepResults *results );
 #ifndef OLD_BUILD
-static void findChunkBounds(const wchar_t *world, int bx, int bz, IBox *worldBox );
+static int initializeSummaries(IBox *worldBox);
+static int summariesComplete();
+static void freeSummaries();
+static int extractSummaries(IBox *worldBox);
 #endif
-static void extractChunk(const wchar_t *world, int bx, int bz, IBox *box );
+static void initializeSweepResults(SweepResults *results);
+static void mergeSweepResults(SweepResults *results);
 
 static int filterBox();
 static int computeFlatFlags( int boxIndex );
@@ -1367,38 +1408,34 @@ static int readTerrainPNG( const wchar_t *curDir, progimage_info *pII, wchar_t *
 
 static int populateBox(const wchar_t *world, IBox *worldBox)
 {
-    int startxblock, startzblock;
-    int endxblock, endzblock;
-    int blockX, blockZ;
-
-    // grab the data block needed, with a border of "air", 0, around the set
-    startxblock=(int)floor((float)worldBox->min[X]/16.0f);
-    startzblock=(int)floor((float)worldBox->min[Z]/16.0f);
-    endxblock=(int)floor((float)worldBox->max[X]/16.0f);
-    endzblock=(int)floor((float)worldBox->max[Z]/16.0f);
-
     // get bounds on Y coordinates, since top part of box is usually air
     VecScalar( gSolidWorldBox.min, =,  999999 );
     VecScalar( gSolidWorldBox.max, =, -999999 );
 
 #ifndef OLD_BUILD
-	// we now extract twice: first time is just to get bounds of solid stuff
-	for ( blockX=startxblock; blockX<=endxblock; blockX++ )
+	// we now go through the data twice: first time is just to get bounds of solid stuff,
+	// keeping a summary of each chunk so the second time doesn't need to read it again.
+	// this method sets gSolidWorldBox
+	initializeSummaries(worldBox);
+	if ( !sweepChunks(world,worldBox,findChunkBounds) )
 	{
-		//UPDATE_PROGRESS( 0.1f*(blockX-startxblock+1)/(endxblock-startxblock+1) );
-		// z increases west, decreases east
-		for ( blockZ=startzblock; blockZ<=endzblock; blockZ++ )
-		{
-			// this method sets gSolidWorldBox
-			findChunkBounds(world,blockX,blockZ,worldBox);
-		}
+		freeSummaries();
+		return MW_WORLD_EXPORT_TOO_LARGE;
 	}
 	if (gSolidWorldBox.min[Y] > gSolidWorldBox.max[Y])
 	{
 		// nothing to do: there is nothing in the box
+		freeSummaries();
 		return MW_NO_BLOCKS_FOUND;
 	}
 
+	// if some summary couldn't be made, the chunks will all be read again: don't
+	// hold on to the rest while the box is allocated and filled
+	if ( !summariesComplete() )
+	{
+		freeSummaries();
+	}
+
 	// done with reading chunk for export, so free memory
 	if ( gOptions->moreExportMemory )
 	{
@@ -1412,6 +1449,9 @@ static int populateBox(const wchar_t *world, IBox *worldBox)
 	gBoxData = (BoxCell*)malloc(gBoxSizeXYZ*sizeof(BoxCell));
 	if ( gBoxData == NULL )
 	{
+#ifndef OLD_BUILD
+		freeSummaries();
+#endif
 		return MW_WORLD_EXPORT_TOO_LARGE;
 	}
 
@@ -1419,23 +1459,21 @@ static int populateBox(const wchar_t *world, IBox *worldBox)
 	memset(gBoxData,0x0,gBoxSizeXYZ*sizeof(BoxCell));
 
 	// Now actually copy the relevant data over to the newly-allocated box data grid.
-    // x increases (old) south (now east), decreases north (now west)
-    for ( blockX=startxblock; blockX<=endxblock; blockX++ )
+#ifndef OLD_BUILD
+	// If a summary couldn't be made, go back to the chunks themselves.
+	if ( !extractSummaries(worldBox) && !sweepChunks(world,worldBox,extractChunk) )
+	{
+		freeSummaries();
+		return MW_WORLD_EXPORT_TOO_LARGE;
+	}
+	freeSummaries();
+#else
+    // this method also sets gSolidWorldBox for OLD_BUILD
+    if ( !sweepChunks(world,worldBox,extractChunk) )
     {
-        //UPDATE_PROGRESS( 0.1f*(blockX-startxblock+1)/(endxblock-startxblock+1) );
-        // z increases west, decreases east
-        for ( blockZ=startzblock; blockZ<=endzblock; blockZ++ )
-        {
-            // this method also sets gSolidWorldBox for OLD_BUILD
-            extractChunk(world,blockX,blockZ,worldBox);
-
-			// done with reading chunk for export, so free memory
-			if ( gOptions->moreExportMemory )
-			{
-				ClearCache();
-			}
-        }
+        return MW_WORLD_EXPORT_TOO_LARGE;
     }
+#endif
 
 #ifdef OLD_BUILD
     if (gSolidWorldBox.min[Y] > gSolidWorldBox.max[Y])
@@ -1464,44 +1502,351 @@ static int populateBox(const wchar_t *world, IBox *worldBox)
     return MW_NO_ERROR;
 }
 
+static void initializeSweepResults(SweepResults *results)
+{
+    int i;
+
+    for ( i = 0; i < MAX_WORKER_THREADS; i++ )
+    {
+        VecScalar( results[i].solidBox.min, =,  999999 );
+        VecScalar( results[i].solidBox.max, =, -999999 );
+        results[i].badBlocks = 0;
+    }
+}
+
+// each chunk was processed by one thread, so merging gives the same answer as
+// processing them all in order
+static void mergeSweepResults(SweepResults *results)
+{
+    int i;
+
+    for ( i = 0; i < MAX_WORKER_THREADS; i++ )
+    {
+        if ( results[i].solidBox.min[Y] <= results[i].solidBox.max[Y] )
+            addBoundsToBounds(results[i].solidBox,&gSolidWorldBox);
+        gBadBlocksInModel += results[i].badBlocks;
+    }
+}
+
+typedef struct ChunkSweep {
+    ChunkProcessor process;
+    IBox *worldBox;
+    ChunkCoord *cached;     // chunks found in the cache
+    WorldBlock **cachedBlocks;
+    SweepResults results[MAX_WORKER_THREADS];
+} ChunkSweep;
+
+static void processCachedJob(int index, int thread, void *userData)
+{
+    ChunkSweep *sweep = (ChunkSweep *)userData;
+
+    sweep->process(sweep->cachedBlocks[index],sweep->cached[index].cx,sweep->cached[index].cz,
+        sweep->worldBox,&sweep->results[thread]);
+}
+
+static int processLoadedBlock(int bx, int bz, WorldBlock *block, int thread, void *userData)
+{
+    ChunkSweep *sweep = (ChunkSweep *)userData;
+
+    sweep->process(block,bx,bz,sweep->worldBox,&sweep->results[thread]);
+
+    // done with reading chunk for export, so free memory, or keep it around for the map
+    return !gOptions->moreExportMemory;
+}
+
+// Run a processor on every chunk overlapping the box, spread over the worker threads.
+// Chunks already in the cache are processed first; the rest are read in bulk, in the
+// order they are stored in their region files, so the order chunks are processed in
+// is arbitrary. Sets gSolidWorldBox and gBadBlocksInModel from what the processor finds.
+// Returns 0, having processed nothing, if there isn't memory to keep track of the chunks.
+static int sweepChunks(const wchar_t *world, IBox *worldBox, ChunkProcessor process)
+{
+    int startxblock, startzblock;
+    int endxblock, endzblock;
+    int blockX, blockZ;
+    int count, cachedCount, numChunks;
+    wchar_t directory[256];
+    ChunkCoord *coords;
+    ChunkSweep *sweep;
+    WorldBlock *block;
+    DecodeRequest request;
+
+    wcsncpy_s(directory,256,world,255);
+    wcsncat_s(directory,256,L"/",1);
+    if (gOptions->worldType&HELL)
+    {
+        wcsncat_s(directory,256,L"DIM-1/",6);
+    }
+    if (gOptions->worldType&ENDER)
+    {
+        wcsncat_s(directory,256,L"DIM1/",5);
+    }
+
+    // grab the data block needed, with a border of "air", 0, around the set
+    startxblock=(int)floor((float)worldBox->min[X]/16.0f);
+    startzblock=(int)floor((float)worldBox->min[Z]/16.0f);
+    endxblock=(int)floor((float)worldBox->max[X]/16.0f);
+    endzblock=(int)floor((float)worldBox->max[Z]/16.0f);
+    numChunks = (endxblock-startxblock+1)*(endzblock-startzblock+1);
+
+    // only the sections the box passes through are needed, and no light
+    request.channels = DECODE_BLOCKS;
+    request.minSection = clamp(worldBox->min[Y]>>4,0,15);
+    request.maxSection = clamp(worldBox->max[Y]>>4,0,15);
+
+    sweep = (ChunkSweep *)malloc(sizeof(ChunkSweep));
+    coords = (ChunkCoord *)malloc(numChunks*sizeof(ChunkCoord));
+    if ( sweep != NULL )
+    {
+        sweep->cached = (ChunkCoord *)malloc(numChunks*sizeof(ChunkCoord));
+        sweep->cachedBlocks = (WorldBlock **)malloc(numChunks*sizeof(WorldBlock *));
+    }
+    if ( sweep == NULL || coords == NULL || sweep->cached == NULL || sweep->cachedBlocks == NULL )
+    {
+        if ( sweep != NULL )
+        {
+            free(sweep->cached);
+            free(sweep->cachedBlocks);
+            free(sweep);
+        }
+        free(coords);
+        return 0;
+    }
+
+    sweep->process = process;
+    sweep->worldBox = worldBox;
+    initializeSweepResults(sweep->results);
+
+    count = cachedCount = 0;
+
+    // x increases (old) south (now east), decreases north (now west)
+    for ( blockX=startxblock; blockX<=endxblock; blockX++ )
+    {
+        // z increases west, decreases east
+        for ( blockZ=startzblock; blockZ<=endzblock; blockZ++ )
+        {
+            // peek, as bringing back a packed block could push out those already found
+            block=(WorldBlock *)Cache_Peek(blockX,blockZ);
+            if ( block != NULL && BLOCK_HAS(block,&request) )
+            {
+                sweep->cached[cachedCount].cx = blockX;
+                sweep->cached[cachedCount].cz = blockZ;
+                sweep->cachedBlocks[cachedCount] = block;
+                cachedCount++;
+            }
+            else
+            {
+                coords[count].cx = blockX;
+                coords[count].cz = blockZ;
+                count++;
+            }
+        }
+    }
+
+    // cached blocks first, as loading more may push them out of the cache
+    RunParallel(cachedCount,processCachedJob,sweep);
+    LoadBlocks(directory,coords,count,&request,processLoadedBlock,sweep);
+
+    mergeSweepResults(sweep->results);
+
+    free(sweep->cached);
+    free(sweep->cachedBlocks);
+    free(sweep);
+    free(coords);
+    return 1;
+}
+
 #ifndef OLD_BUILD
-// test relevant part of a given chunk to find its size
-static void findChunkBounds(const wchar_t *world, int bx, int bz, IBox *worldBox )
+// Allocate a summary for each chunk in the box, to be filled in by findChunkBounds.
+// Returns 0 if there isn't memory for them; the export then reads chunks twice.
+static int initializeSummaries(IBox *worldBox)
 {
-	int chunkX, chunkZ;
+    gSummaryStartX=(int)floor((float)worldBox->min[X]/16.0f);
+    gSummaryStartZ=(int)floor((float)worldBox->min[Z]/16.0f);
+    gSummaryNumX=(int)floor((float)worldBox->max[X]/16.0f) - gSummaryStartX + 1;
+    gSummaryNumZ=(int)floor((float)worldBox->max[Z]/16.0f) - gSummaryStartZ + 1;
+
+    // chunks that don't exist are never visited, and so stay empty
+    gChunkSummaries = (ChunkSummary *)calloc(gSummaryNumX*gSummaryNumZ,sizeof(ChunkSummary));
+    return (gChunkSummaries != NULL);
+}
 
-	int loopXmin, loopZmin;
-	int loopXmax, loopZmax;
-	int x,y,z;
+// returns 0 if some chunk's summary couldn't be made
+static int summariesComplete()
+{
+    int i;
 
-	int chunkIndex, boxIndex;
-	int blockID;
+    if ( gChunkSummaries == NULL )
+        return 0;
+    for ( i = 0; i < gSummaryNumX*gSummaryNumZ; i++ )
+    {
+        if ( gChunkSummaries[i].failed )
+            return 0;
+    }
+    return 1;
+}
 
-	//unsigned char dataVal;
+static void freeSummaries()
+{
+    int i;
+
+    if ( gChunkSummaries == NULL )
+        return;
+
+    for ( i = 0; i < gSummaryNumX*gSummaryNumZ; i++ )
+    {
+        free(gChunkSummaries[i].slab);
+    }
+    free(gChunkSummaries);
+    gChunkSummaries = NULL;
+}
 
-	WorldBlock *block;
-	block=(WorldBlock *)Cache_Find(bx,bz);
+// the rows of a section that a summary keeps, and the first of them
+static int sectionRows( const ChunkSummary *summary, int section, int *first )
+{
+    *first = max(summary->ymin, section*16);
+    return min(summary->ymax, section*16+15) - *first + 1;
+}
 
-	if (block==NULL)
+// Chunks are stored by Y, then Z, then X; the box and the summaries by X, then Z, then Y.
+// These turn a 16x16 tile of one around, for a fixed Z, so that each X gets its 16 Ys.
+
+// transpose 16 rows of 16 bytes, each stride apart, so that dst[x][y] = src row y, byte x
+static void transposeTile( unsigned char dst[16][16], const unsigned char *src, int stride )
+{
+#ifdef EXTRACT_SSE2
+	__m128i row[16], out[16];
+	int i, pass;
+	for ( i = 0; i < 16; i++ )
+		row[i] = _mm_loadu_si128((const __m128i *)(src + i*stride));
+	// interleaving row i with row i+8 four times over transposes the tile
+	for ( pass = 0; pass < 4; pass++ )
 	{
-		wchar_t directory[256];
-		wcsncpy_s(directory,256,world,255);
-		wcsncat_s(directory,256,L"/",1);
-		if (gOptions->worldType&HELL)
-		{
-			wcsncat_s(directory,256,L"DIM-1/",6);
-		}
-		if (gOptions->worldType&ENDER)
+		for ( i = 0; i < 8; i++ )
 		{
-			wcsncat_s(directory,256,L"DIM1/",5);
+			out[2*i] = _mm_unpacklo_epi8(row[i],row[i+8]);
+			out[2*i+1] = _mm_unpackhi_epi8(row[i],row[i+8]);
 		}
+		memcpy(row,out,sizeof(row));
+	}
+	for ( i = 0; i < 16; i++ )
+		_mm_storeu_si128((__m128i *)dst[i],row[i]);
+#else
+	int x,y;
+	for ( y = 0; y < 16; y++ )
+		for ( x = 0; x < 16; x++ )
+			dst[x][y] = src[y*stride+x];
+#endif
+}
 
-		block=LoadBlock(directory,bx,bz);
-		if (block==NULL) //blank tile, nothing to do
-			return;
+// spread count (at most 16) half-byte data values, the first in the low half of src[0], to a byte each
+static void unpackNibbles( unsigned char dst[16], const unsigned char *src, int count )
+{
+	int i;
+#ifdef EXTRACT_SSE2
+	if ( count == 16 )
+	{
+		__m128i packed = _mm_loadl_epi64((const __m128i *)src);
+		__m128i lowHalf = _mm_and_si128(packed,_mm_set1_epi8(0xf));
+		__m128i highHalf = _mm_and_si128(_mm_srli_epi16(packed,4),_mm_set1_epi8(0xf));
+		_mm_storeu_si128((__m128i *)dst,_mm_unpacklo_epi8(lowHalf,highHalf));
+		return;
+	}
+#endif
+	for ( i = 0; i < count; i++ )
+		dst[i] = (unsigned char)((src[i/2] >> ((i&1)*4)) & 0xf);
+}
+
+// and pack them back up, into (count+1)/2 bytes
+static void packNibbles( unsigned char *dst, const unsigned char *src, int count )
+{
+	int i;
+	for ( i = 0; i+1 < count; i += 2 )
+		dst[i/2] = (unsigned char)(src[i] | (src[i+1] << 4));
+	if ( count & 1 )
+		dst[count/2] = src[count-1];
+}
+
+// the same as transposeTile for 16 rows of 16 data values, 8 bytes each, giving a byte per value
+static void transposeNibbleTile( unsigned char dst[16][16], const unsigned char *src, int stride )
+{
+	unsigned char rows[16][16];
+	int y;
+	for ( y = 0; y < 16; y++ )
+		unpackNibbles(rows[y],src + y*stride,16);
+	transposeTile(dst,&rows[0][0],16);
+}
 
-		Cache_Add(bx,bz,block);
+// store count IDs and data values, a byte each, into successive cells of the box,
+// which must still be as it was cleared. Returns the number of unknown blocks.
+static int setBoxColumn( BoxCell *cells, const unsigned char *ids, const unsigned char *data, int count, int notSchematic )
+{
+	int i, badBlocks = 0;
+#ifdef EXTRACT_SSE2
+	if ( count == 16 )
+	{
+		__m128i zero = _mm_setzero_si128();
+		__m128i id = _mm_loadu_si128((const __m128i *)ids);
+		__m128i dataVal = _mm_loadu_si128((const __m128i *)data);
+		__m128i types, typesAndData, upper;
+
+		// special: if it's a wire, clear the data value. We use this later for
+		// how the wires actually connect to each other.
+		if ( notSchematic )
+			dataVal = _mm_andnot_si128(_mm_cmpeq_epi8(id,_mm_set1_epi8((char)BLOCK_REDSTONE_WIRE)),dataVal);
+		for ( i = _mm_movemask_epi8(_mm_cmpeq_epi8(id,_mm_set1_epi8((char)BLOCK_UNKNOWN))); i; i &= i-1 )
+			badBlocks++;
+
+		// each cell is group (0), type, origType, flatFlags (0), data
+		types = _mm_unpacklo_epi8(id,id);
+		typesAndData = _mm_unpacklo_epi8(zero,dataVal);
+		upper = _mm_unpacklo_epi16(types,typesAndData);
+		_mm_storeu_si128((__m128i *)&cells[0],_mm_unpacklo_epi32(zero,upper));
+		_mm_storeu_si128((__m128i *)&cells[2],_mm_unpackhi_epi32(zero,upper));
+		upper = _mm_unpackhi_epi16(types,typesAndData);
+		_mm_storeu_si128((__m128i *)&cells[4],_mm_unpacklo_epi32(zero,upper));
+		_mm_storeu_si128((__m128i *)&cells[6],_mm_unpackhi_epi32(zero,upper));
+		types = _mm_unpackhi_epi8(id,id);
+		typesAndData = _mm_unpackhi_epi8(zero,dataVal);
+		upper = _mm_unpacklo_epi16(types,typesAndData);
+		_mm_storeu_si128((__m128i *)&cells[8],_mm_unpacklo_epi32(zero,upper));
+		_mm_storeu_si128((__m128i *)&cells[10],_mm_unpackhi_epi32(zero,upper));
+		upper = _mm_unpackhi_epi16(types,typesAndData);
+		_mm_storeu_si128((__m128i *)&cells[12],_mm_unpacklo_epi32(zero,upper));
+		_mm_storeu_si128((__m128i *)&cells[14],_mm_unpackhi_epi32(zero,upper));
+		return badBlocks;
+	}
+#endif
+	for ( i = 0; i < count; i++ )
+	{
+		cells[i].data = data[i];
+		cells[i].origType = cells[i].type = ids[i];
+		// TODO: We could still save the wire's value, then use the high 4 bits for the
+		// connection values. The only headache: need a new "wire off" set of tiles.
+		if ( (ids[i] == BLOCK_REDSTONE_WIRE) && notSchematic )
+			cells[i].data = 0x0;
+		else if ( ids[i] == BLOCK_UNKNOWN )
+			badBlocks++;
 	}
+	return badBlocks;
+}
+
+// test relevant part of a given chunk to find its size, and summarize it for extractSummaries
+static void findChunkBounds(WorldBlock *block, int bx, int bz, IBox *worldBox, SweepResults *results )
+{
+	ChunkSummary *summary;
+	int chunkX, chunkZ;
+
+	int loopXmin, loopZmin;
+	int loopXmax, loopZmax;
+	int x,y,z;
+
+	int chunkIndex, skip;
+	int blockID, dataVal;
+	int section, numColumns, numZ, column, rows, firstRow, dataBytes;
+	size_t slabBytes;
+	unsigned char *pID, *pData;
+	unsigned char ids[16][16], dataVals[16][16];
 
 	// loop through area of box that overlaps with this chunk
 	chunkX = bx * 16;
@@ -1513,12 +1858,39 @@ static void findChunkBounds(const wchar_t *world, int bx, int bz, IBox *worldBox
 	loopXmax = min(worldBox->max[X],chunkX+15);
 	loopZmax = min(worldBox->max[Z],chunkZ+15);
 
+	summary = (gChunkSummaries == NULL) ? NULL :
+		&gChunkSummaries[(bx-gSummaryStartX)*gSummaryNumZ + (bz-gSummaryStartZ)];
+	if ( summary != NULL )
+	{
+		summary->xmin = loopXmin;
+		summary->xmax = loopXmax;
+		summary->zmin = loopZmin;
+		summary->zmax = loopZmax;
+		summary->ymin = worldBox->min[Y];
+		summary->ymax = worldBox->max[Y];
+	}
+
 	for ( x = loopXmin; x <= loopXmax; x++ ) {
 		for ( z = loopZmin; z <= loopZmax; z++ ) {
-			boxIndex = WORLD_TO_BOX_INDEX(x,worldBox->min[Y],z);
+			int ymin = 999999;
+			int ymax = -999999;
+
 			chunkIndex = CHUNK_INDEX(bx,bz,x,worldBox->min[Y],z);
-			for ( y = worldBox->min[Y]; y <= worldBox->max[Y]; y++, boxIndex++ ) {
+			for ( y = worldBox->min[Y]; y <= worldBox->max[Y]; y++ ) {
+				// nothing to find in the rest of an empty section
+				if ( !(block->sectionMask & (1 << (y>>4))) )
+				{
+					skip = min(15 - (y&0xf), worldBox->max[Y] - y);
+					y += skip;
+					chunkIndex += (skip+1)*256;
+					continue;
+				}
 				blockID = block->grid[chunkIndex];
+				dataVal = block->data[chunkIndex/2];
+				if ( chunkIndex & 0x01 )
+					dataVal = dataVal >> 4;
+				else
+					dataVal &= 0xf;
 
 				// For Anvil, Y goes up by 256 (in 1.1 and earlier, it was just ++)
 				chunkIndex += 256;
@@ -1528,57 +1900,174 @@ static void findChunkBounds(const wchar_t *world, int bx, int bz, IBox *worldBox
 				// add to vertical bounds.
 				if ( blockID > BLOCK_AIR )
 				{
-					IPoint loc;
-					Vec3Scalar( loc, =, x,y,z );
-					addBounds(loc,&gSolidWorldBox);
+					if ( y < ymin )
+						ymin = y;
+					ymax = y;
 				}
+				// air can have a data value, too, which the box keeps
+				if ( ( blockID | dataVal ) && ( summary != NULL ) )
+				{
+					summary->sectionMask |= (unsigned short)(1 << (y>>4));
+				}
+			}
+
+			// the column's solid height range is all the bounds need
+			if ( ymin <= ymax )
+			{
+				IPoint loc;
+				Vec3Scalar( loc, =, x,ymin,z );
+				addBounds(loc,&results->solidBox);
+				loc[Y] = ymax;
+				addBounds(loc,&results->solidBox);
+			}
+		}
+	}
+
+	if ( summary == NULL || summary->sectionMask == 0 )
+		return;
+
+	// keep the box's part of the sections with something in them, for the overlapping columns
+	numColumns = (loopXmax-loopXmin+1)*(loopZmax-loopZmin+1);
+	slabBytes = 0;
+	for ( section = 0; section < 16; section++ ) {
+		if ( summary->sectionMask & (1<<section) )
+		{
+			rows = sectionRows(summary,section,&firstRow);
+			slabBytes += numColumns*(rows + (rows+1)/2);
+		}
+	}
+	summary->slab = (unsigned char *)malloc(slabBytes);
+	if ( summary->slab == NULL )
+	{
+		summary->failed = 1;
+		return;
+	}
+
+	pID = summary->slab;
+	numZ = loopZmax-loopZmin+1;
+	for ( section = 0; section < 16; section++ ) {
+		if ( !(summary->sectionMask & (1<<section)) )
+			continue;
+		rows = sectionRows(summary,section,&firstRow);
+		dataBytes = (rows+1)/2;
+		pData = pID + numColumns*rows;
+		for ( z = loopZmin; z <= loopZmax; z++ ) {
+			// turn the section's row of X at this Z into a column of Y per X
+			chunkIndex = CHUNK_INDEX(bx,bz,chunkX,section*16,z);
+			transposeTile(ids,&block->grid[chunkIndex],256);
+			transposeNibbleTile(dataVals,&block->data[chunkIndex/2],128);
+			for ( x = loopXmin; x <= loopXmax; x++ ) {
+				column = (x-loopXmin)*numZ + (z-loopZmin);
+				memcpy(pID + column*rows,&ids[x-chunkX][firstRow&0xf],rows);
+				packNibbles(pData + column*dataBytes,&dataVals[x-chunkX][firstRow&0xf],rows);
 			}
 		}
+		pID = pData + numColumns*dataBytes;
 	}
 }
+
+typedef struct SummaryExtract {
+	IBox *worldBox;
+	SweepResults results[MAX_WORKER_THREADS];
+} SummaryExtract;
+
+static void extractSummaryJob(int index, int thread, void *userData)
+{
+	SummaryExtract *extract = (SummaryExtract *)userData;
+	ChunkSummary *summary = &gChunkSummaries[index];
+	IBox *worldBox = extract->worldBox;
+
+	int notSchematic = (gOptions->pEFD->fileType != FILE_TYPE_SCHEMATIC);
+
+	int loopXmin, loopZmin;
+	int loopXmax, loopZmax;
+	int x,z;
+	int ymin, ymax;
+
+	int boxIndex;
+	int section, numColumns, rows, firstRow, dataBytes;
+	unsigned char *pID, *pData;
+	unsigned char dataVals[16];
+
+	if ( summary->slab == NULL )
+		return;
+
+	// the box has shrunk to the solid bounds since the summary was made
+	loopXmin = max(worldBox->min[X],summary->xmin);
+	loopZmin = max(worldBox->min[Z],summary->zmin);
+
+	loopXmax = min(worldBox->max[X],summary->xmax);
+	loopZmax = min(worldBox->max[Z],summary->zmax);
+
+	numColumns = (summary->xmax-summary->xmin+1)*(summary->zmax-summary->zmin+1);
+	pID = summary->slab;
+
+	for ( section = 0; section < 16; section++ ) {
+		if ( !(summary->sectionMask & (1<<section)) )
+			continue;
+		rows = sectionRows(summary,section,&firstRow);
+		dataBytes = (rows+1)/2;
+		pData = pID + numColumns*rows;
+		// the box may have shrunk, but only ever within the rows kept
+		ymin = max(worldBox->min[Y],firstRow);
+		ymax = min(worldBox->max[Y],firstRow+rows-1);
+		for ( x = loopXmin; x <= loopXmax && ymin <= ymax; x++ ) {
+			for ( z = loopZmin; z <= loopZmax; z++ ) {
+				int column = (x-summary->xmin)*(summary->zmax-summary->zmin+1) + (z-summary->zmin);
+				unpackNibbles(dataVals,pData + column*dataBytes,rows);
+				boxIndex = WORLD_TO_BOX_INDEX(x,ymin,z);
+				extract->results[thread].badBlocks += setBoxColumn(&gBoxData[boxIndex],
+					pID + column*rows + (ymin-firstRow),dataVals + (ymin-firstRow),ymax-ymin+1,notSchematic);
+			}
+		}
+		pID = pData + numColumns*dataBytes;
+	}
+
+	// done with it: give the memory back while the rest are extracted
+	free(summary->slab);
+	summary->slab = NULL;
+}
+
+// Fill in the box data grid from the chunk summaries. Returns 0 if some chunk has no
+// summary, in which case nothing is done.
+static int extractSummaries(IBox *worldBox)
+{
+	SummaryExtract extract;
+
+	if ( !summariesComplete() )
+		return 0;
+
+	extract.worldBox = worldBox;
+	initializeSweepResults(extract.results);
+	RunParallel(gSummaryNumX*gSummaryNumZ,extractSummaryJob,&extract);
+	mergeSweepResults(extract.results);
+	return 1;
+}
+
 #endif
 
 // copy relevant part of a given chunk to the box data grid
-static void extractChunk(const wchar_t *world, int bx, int bz, IBox *worldBox )
+static void extractChunk(WorldBlock *block, int bx, int bz, IBox *worldBox, SweepResults *results )
 {
     int chunkX, chunkZ;
 
     int loopXmin, loopZmin;
     int loopXmax, loopZmax;
-    int x,y,z;
+    int x,z;
 
     int chunkIndex, boxIndex;
-    int blockID;
+#ifdef OLD_BUILD
+    int y, blockID, skip;
+#else
+    int section, ymin, ymax;
+    unsigned char ids[16][16], dataVals[16][16];
 
 	int notSchematic = (gOptions->pEFD->fileType != FILE_TYPE_SCHEMATIC);
+#endif
 
     //IPoint loc;
     //unsigned char dataVal;
 
-    WorldBlock *block;
-    block=(WorldBlock *)Cache_Find(bx,bz);
-
-    if (block==NULL)
-    {
-        wchar_t directory[256];
-        wcsncpy_s(directory,256,world,255);
-        wcsncat_s(directory,256,L"/",1);
-        if (gOptions->worldType&HELL)
-        {
-            wcsncat_s(directory,256,L"DIM-1/",6);
-        }
-        if (gOptions->worldType&ENDER)
-        {
-            wcsncat_s(directory,256,L"DIM1/",5);
-        }
-
-		block=LoadBlock(directory,bx,bz);
-        if (block==NULL) //blank tile, nothing to do
-            return;
-
-        Cache_Add(bx,bz,block);
-    }
-
     // loop through area of box that overlaps with this chunk
     chunkX = bx * 16;
     chunkZ = bz * 16;
@@ -1589,11 +2078,21 @@ static void extractChunk(const wchar_t *world, int bx, int bz, IBox *worldBox )
     loopXmax = min(worldBox->max[X],chunkX+15);
     loopZmax = min(worldBox->max[Z],chunkZ+15);
 
+#ifdef OLD_BUILD
     for ( x = loopXmin; x <= loopXmax; x++ ) {
         for ( z = loopZmin; z <= loopZmax; z++ ) {
             boxIndex = WORLD_TO_BOX_INDEX(x,worldBox->min[Y],z);
             chunkIndex = CHUNK_INDEX(bx,bz,x,worldBox->min[Y],z);
             for ( y = worldBox->min[Y]; y <= worldBox->max[Y]; y++, boxIndex++ ) {
+                // the box starts out as plain air, so an empty section can be left as is
+                if ( !(block->sectionMask & (1 << (y>>4))) )
+                {
+                    skip = min(15 - (y&0xf), worldBox->max[Y] - y);
+                    y += skip;
+                    boxIndex += skip;
+                    chunkIndex += (skip+1)*256;
+                    continue;
+                }
                 // Get the extra values (orientation, type) for the blocks
                 unsigned char dataVal = block->data[chunkIndex/2];
                 if ( chunkIndex & 0x01 )
@@ -1606,12 +2105,11 @@ static void extractChunk(const wchar_t *world, int bx, int bz, IBox *worldBox )
 
 				// For Anvil, Y goes up by 256 (in 1.1 and earlier, it was just ++)
 				chunkIndex += 256;
-#ifdef OLD_BUILD
 				if ( blockID > BLOCK_AIR )
 				{
 					IPoint loc;
 					Vec3Scalar( loc, =, x,y,z );
-					addBounds(loc,&gSolidWorldBox);
+					addBounds(loc,&results->solidBox);
 
 					// special: if it's a wire, clear the data value. We use this later for
 					// how the wires actually connect to each other.
@@ -1620,33 +2118,32 @@ static void extractChunk(const wchar_t *world, int bx, int bz, IBox *worldBox )
 						gBoxData[boxIndex].data = 0x0;
 					}
 				}
+            }
+        }
+    }
 #else
-                // get bounds on y searches:
-                // search for air, and if not found then
-                // add to vertical bounds.
-				// now done by findChunkBounds:
-                //if ( blockID > BLOCK_AIR )
-                //{
-                    //Vec3Scalar( loc, =, x,y,z );
-                    //addBounds(loc,&gSolidWorldBox);
-
-                    // special: if it's a wire, clear the data value. We use this later for
-                    // how the wires actually connect to each other.
-					// TODO: We could still save the value, then use the high 4 bits for the
-					// connection values. The only headache: need a new "wire off" set of tiles.
-                    if ( (blockID == BLOCK_REDSTONE_WIRE) && notSchematic )
-                    {
-                        gBoxData[boxIndex].data = 0x0;
-                    }
-					else if ( blockID == BLOCK_UNKNOWN )
-					{
-						gBadBlocksInModel++;
-					}
-                //}
-#endif
+    // bounds are found by findChunkBounds
+    for ( section = 0; section < 16; section++ ) {
+        // the box starts out as plain air, so an empty section can be left as is
+        if ( !(block->sectionMask & (1<<section)) )
+            continue;
+        ymin = max(worldBox->min[Y],section*16);
+        ymax = min(worldBox->max[Y],section*16+15);
+        if ( ymin > ymax )
+            continue;
+        for ( z = loopZmin; z <= loopZmax; z++ ) {
+            // turn the section's row of X at this Z into a column of Y per X
+            chunkIndex = CHUNK_INDEX(bx,bz,chunkX,section*16,z);
+            transposeTile(ids,&block->grid[chunkIndex],256);
+            transposeNibbleTile(dataVals,&block->data[chunkIndex/2],128);
+            for ( x = loopXmin; x <= loopXmax; x++ ) {
+                boxIndex = WORLD_TO_BOX_INDEX(x,ymin,z);
+                results->badBlocks += setBoxColumn(&gBoxData[boxIndex],
+                    ids[x-chunkX] + (ymin & 0xf),dataVals[x-chunkX] + (ymin & 0xf),ymax-ymin+1,notSchematic);
             }
         }
     }
+#endif
 }
 
 // remove snow blocks and anything else not desired
@@ -30,90 +30,1002 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#ifdef __linux__
+#include <sys/sysinfo.h>
+#include <sys/mman.h>
+#endif
 
-/* a simple cache based on a hashtable with separate chaining */
+/* a simple cache based on a hashtable with separate chaining, plus
+ * recency lists to pick which block to throw out when it is full */
 
 // these must be powers of two
 #define HASH_XDIM 64
 #define HASH_ZDIM 64
 #define HASH_SIZE (HASH_XDIM * HASH_ZDIM)
 
-// arbitrary, let users tune this?
-// 6000 entries translates to Mineways using ~300MB of RAM (on x64)
+// The cache is limited by the memory its blocks take up, packed ones included. Unless
+// told otherwise, it may use a quarter of the physical memory the program can get.
+#define DEFAULT_BUDGET_DIVISOR 4
+// never go below this many blocks' worth, nor above what a 32-bit process can hold
+#define MIN_BUDGET_BLOCKS 64
+#define MAX_BUDGET_32BIT ((size_t)512*1024*1024)
 
-static int gHashMaxEntries=INITIAL_CACHE_SIZE;   // was 6000, Sean said to increase it - really should be 30000, because export memory toggle now changes it to this
+static size_t gCacheBudget=0;   // 0 until first needed
+static size_t gCacheFloor=0;    // what the map asks for, up to gMemoryBudget
+static size_t gMemoryBudget=0;  // what the machine can spare, once worked out
+static size_t gCacheBytes=0;    // memory held by the blocks in the cache
+static size_t gPackedBytes=0;   // and by the packed blocks pushed out of it
+
+/* Blocks and cache entries come from slabs: large allocations, each carved into
+ * many objects of one size. Slabs with free objects are kept on a list, each with
+ * its own free list, so allocating and freeing are O(1), and a slab whose objects
+ * are all free can be given back. Emptying the whole cache just drops the slabs.
+ */
+
+#define BLOCKS_PER_SLAB 64      // about 8.5MB
+#define ENTRIES_PER_SLAB 1024
+
+// each object is preceded by a pointer to its slab. Objects are 16-byte aligned.
+#define SLOT_HEADER 16
+#define SLAB_HEADER 64
+#define SLOT_SIZE(objectSize) ((SLOT_HEADER + (objectSize) + 15) & ~(size_t)15)
+
+typedef struct pool_slab {
+    struct pool_slab *prev, *next;          // slabs with free objects
+    struct pool_slab *allPrev, *allNext;    // every slab of the pool
+    char *freeList;     // free slots, linked through the object area
+    int used;           // objects handed out
+    int largePages;     // allocated with large pages
+    size_t bytes;
+} pool_slab;
+
+typedef struct {
+    size_t slotSize;    // object size plus SLOT_HEADER
+    int perSlab;
+    int largePages;     // may use large pages; only worth it for slabs near their size
+    pool_slab *partial; // slabs with free objects
+    pool_slab *all;
+    int used;           // objects handed out
+    int capacity;       // objects in all slabs
+    size_t bytes;       // memory held by all slabs
+} pool;
+
+#if defined(WIN32) || defined(MADV_HUGEPAGE)
+// try large pages for slabs? Turned off for good once the system refuses them.
+static int gUseLargePages=1;
+#endif
+#ifdef MADV_HUGEPAGE
+// Linux's transparent huge pages are 2MB on x86 and most ARM kernels
+#define HUGE_PAGE_SIZE ((size_t)2*1024*1024)
+#endif
+
+// allowLarge says whether large pages may be used. A slab is rounded up to a whole
+// number of them, and on Windows they can't be paged out, so that's only for big slabs.
+static void *slab_memory(size_t *bytes, int allowLarge, int *largePages) {
+    void *mem;
+#ifdef WIN32
+    size_t large = (gUseLargePages && allowLarge) ? GetLargePageMinimum() : 0;
+    if (large > 0) {
+        // needs the "lock pages in memory" privilege; few users have it
+        size_t rounded = (*bytes + large - 1) / large * large;
+        mem = VirtualAlloc(NULL, rounded, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (mem != NULL) {
+            *bytes = rounded;
+            *largePages = 1;
+            return mem;
+        }
+        gUseLargePages = 0;
+    }
+    *largePages = 0;
+    return VirtualAlloc(NULL, *bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#elif defined(MADV_HUGEPAGE)
+    if (gUseLargePages && allowLarge) {
+        // the kernel backs aligned memory it's advised of with huge pages when it can
+        size_t rounded = (*bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        if (posix_memalign(&mem, HUGE_PAGE_SIZE, rounded) != 0)
+            return NULL;
+        *bytes = rounded;
+        *largePages = (madvise(mem, rounded, MADV_HUGEPAGE) == 0);
+        if (!*largePages)
+            gUseLargePages = 0;     // built without them
+        return mem;
+    }
+    *largePages = 0;
+    return malloc(*bytes);
+#else
+    (void)allowLarge;
+    *largePages = 0;
+    mem = malloc(*bytes);
+    return mem;
+#endif
+}
+
+static void slab_memory_free(pool_slab *slab) {
+#ifdef WIN32
+    VirtualFree(slab, 0, MEM_RELEASE);
+#else
+    free(slab);
+#endif
+}
+
+static void partial_unlink(pool *p, pool_slab *slab) {
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        p->partial = slab->next;
+    if (slab->next != NULL)
+        slab->next->prev = slab->prev;
+}
+
+static void partial_push(pool *p, pool_slab *slab) {
+    slab->prev = NULL;
+    slab->next = p->partial;
+    if (p->partial != NULL)
+        p->partial->prev = slab;
+    p->partial = slab;
+}
+
+static pool_slab *slab_new(pool *p) {
+    pool_slab *slab;
+    size_t bytes = SLAB_HEADER + p->perSlab * p->slotSize;
+    int largePages, count, i;
+    char *slot;
+
+    slab = (pool_slab *)slab_memory(&bytes, p->largePages, &largePages);
+    if (slab == NULL)
+        return NULL;
+    // large pages may leave room for more
+    count = (int)((bytes - SLAB_HEADER) / p->slotSize);
+
+    slab->freeList = NULL;
+    slot = (char *)slab + SLAB_HEADER + (count - 1) * p->slotSize;
+    for (i = 0; i < count; i++, slot -= p->slotSize) {
+        *(pool_slab **)slot = slab;
+        *(char **)(slot + SLOT_HEADER) = slab->freeList;
+        slab->freeList = slot;
+    }
+    slab->used = 0;
+    slab->largePages = largePages;
+    slab->bytes = bytes;
+
+    slab->allPrev = NULL;
+    slab->allNext = p->all;
+    if (p->all != NULL)
+        p->all->allPrev = slab;
+    p->all = slab;
+    partial_push(p, slab);
+
+    p->capacity += count;
+    p->bytes += bytes;
+    return slab;
+}
+
+static void slab_release(pool *p, pool_slab *slab) {
+    partial_unlink(p, slab);
+    if (slab->allPrev != NULL)
+        slab->allPrev->allNext = slab->allNext;
+    else
+        p->all = slab->allNext;
+    if (slab->allNext != NULL)
+        slab->allNext->allPrev = slab->allPrev;
+    p->capacity -= (int)((slab->bytes - SLAB_HEADER) / p->slotSize);
+    p->bytes -= slab->bytes;
+    slab_memory_free(slab);
+}
+
+static void *pool_alloc(pool *p) {
+    pool_slab *slab = p->partial;
+    char *slot;
+
+    if (slab == NULL) {
+        slab = slab_new(p);
+        if (slab == NULL)
+            return NULL;
+    }
+    slot = slab->freeList;
+    slab->freeList = *(char **)(slot + SLOT_HEADER);
+    if (slab->freeList == NULL)
+        partial_unlink(p, slab);
+    slab->used++;
+    p->used++;
+    return slot + SLOT_HEADER;
+}
+
+static void pool_free(pool *p, void *object) {
+    char *slot = (char *)object - SLOT_HEADER;
+    pool_slab *slab = *(pool_slab **)slot;
+
+    if (slab->freeList == NULL)
+        partial_push(p, slab);
+    *(char **)(slot + SLOT_HEADER) = slab->freeList;
+    slab->freeList = slot;
+    slab->used--;
+    p->used--;
+
+    // give back empty slabs, but keep one around so alloc/free pairs don't thrash
+    if (slab->used == 0 && !(p->partial == slab && slab->next == NULL))
+        slab_release(p, slab);
+}
+
+// give back every slab, whether or not its objects are in use
+static void pool_reset(pool *p) {
+    pool_slab *slab, *next;
+
+    for (slab = p->all; slab != NULL; slab = next) {
+        next = slab->allNext;
+        slab_memory_free(slab);
+    }
+    p->partial = NULL;
+    p->all = NULL;
+    p->used = 0;
+    p->capacity = 0;
+    p->bytes = 0;
+}
+
+static int block_pool_reset(int cachedBlocks);
 
 typedef struct block_entry {
     int x, z;
-    struct block_entry *next;
+    struct block_entry *next;       // hash chain
+    struct block_entry *newer;      // recency list
+    struct block_entry *older;
+    int list;                       // which recency list the entry is on
+    unsigned int held;              // gHoldGeneration if held by Cache_Hold
+    size_t bytes;                   // memory held by data
     WorldBlock *data;
 } block_entry;
 
+// recency lists, most recently used first
+#define PROBATION 0     // used once since it was added (2Q only)
+#define PROTECTED 1     // used more than once; everything, for plain LRU
+
 typedef struct {
-    int x, z;
-} IPoint2;
+    block_entry *newest, *oldest;
+    size_t bytes;
+} block_list;
 
 static block_entry **gBlockCache=NULL;
 
-static IPoint2 *gCacheHistory=NULL;
-static int gCacheN=0;
+// cache entries are only used by the main thread, so need no lock
+static pool gEntryPool = { SLOT_SIZE(sizeof(block_entry)), ENTRIES_PER_SLAB, 0 };
+
+static block_list gLists[2];
+static int gCachePolicy=CACHE_POLICY_2Q;
+
+// entries whose held matches this aren't evicted; Cache_ReleaseHeld moves it on
+static unsigned int gHoldGeneration=1;
+
+// with 2Q, the share of the cache that chunks seen only once can push others out of.
+// An export sweep touches each chunk once, so it churns through this part only.
+#define PROBATION_PERCENT 25
 
 static int hash_coord(int x, int z) {
     return (x&(HASH_XDIM-1))*(HASH_ZDIM) + (z & (HASH_ZDIM - 1));
 }
 
 static block_entry* hash_new(int x, int z, void* data, block_entry* next) {
-    block_entry* ret = (block_entry*)malloc(sizeof(block_entry));
+    block_entry* ret = (block_entry*)pool_alloc(&gEntryPool);
+    if (ret == NULL)
+        return NULL;
     ret->x = x;
     ret->z = z;
     ret->data = (WorldBlock*)data;
+    ret->held = 0;
     ret->next = next;
     return ret;
 }
 
+static block_entry* hash_find(int x, int z) {
+    block_entry *entry;
+
+    if (gBlockCache == NULL)
+        return NULL;
+    for (entry = gBlockCache[hash_coord(x, z)]; entry != NULL; entry = entry->next)
+        if (entry->x == x && entry->z == z)
+            return entry;
+    return NULL;
+}
+
+static void list_unlink(block_entry *entry) {
+    block_list *list = &gLists[entry->list];
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+    else
+        list->newest = entry->older;
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else
+        list->oldest = entry->newer;
+    list->bytes -= entry->bytes;
+}
+
+static void list_push(int which, block_entry *entry) {
+    block_list *list = &gLists[which];
+    entry->list = which;
+    entry->newer = NULL;
+    entry->older = list->newest;
+    if (list->newest != NULL)
+        list->newest->newer = entry;
+    else
+        list->oldest = entry;
+    list->newest = entry;
+    list->bytes += entry->bytes;
+}
+
+// add at the old end of a list
+static void list_append(int which, block_entry *entry) {
+    block_list *list = &gLists[which];
+    entry->list = which;
+    entry->older = NULL;
+    entry->newer = list->oldest;
+    if (list->oldest != NULL)
+        list->oldest->older = entry;
+    else
+        list->newest = entry;
+    list->oldest = entry;
+    list->bytes += entry->bytes;
+}
+
+static size_t get_budget();
+
+// with 2Q, keep room for blocks on probation: the protected list's oldest go back
+// on probation, as the newest there, when it grows too long
+static void trim_protected() {
+    size_t protectedMax;
+
+    if (gCachePolicy == CACHE_POLICY_LRU)
+        return;
+    // the packed blocks take their share of the budget first
+    protectedMax = (get_budget() - min(gPackedBytes, get_budget())) / 100 * (100 - PROBATION_PERCENT);
+    while (gLists[PROTECTED].bytes > protectedMax) {
+        block_entry *demoted = gLists[PROTECTED].oldest;
+        list_unlink(demoted);
+        list_push(PROBATION, demoted);
+    }
+}
+
+// note that an entry was just used
+static void cache_touch(block_entry *entry) {
+    list_unlink(entry);
+    list_push(PROTECTED, entry);
+    trim_protected();
+}
+
+/* Second tier: blocks pushed out of the cache are kept packed, in far less memory
+ * than a WorldBlock - most of one is air. Unpacking one is much cheaper than reading
+ * and inflating the chunk again. The whole block is kept, its last render included.
+ * The cache itself keeps blocks unpacked, for the map and exports to read directly:
+ * draw() and the export index grid, data and light in well over a hundred places, and
+ * their inner loops would pay for an accessor on every voxel. So only this tier is
+ * palette coded; a resident block stays its full size, about 140KB with the column
+ * occupancy the map keeps, and packing saves memory only for blocks out of the cache.
+ */
+
+typedef struct packed_entry {
+    int x, z;
+    struct packed_entry *next;      // hash chain
+    struct packed_entry *newer;     // recency list
+    struct packed_entry *older;
+    size_t bytes;                   // memory held by the entry, packed data included
+    size_t length;                  // bytes of packed data, which follows the entry
+} packed_entry;
+
+static packed_entry **gPackedCache=NULL;
+static packed_entry *gPackedNewest=NULL, *gPackedOldest=NULL;
+static size_t gPackedBudget=0;
+static int gPackedBudgetSet=0;  // 0 to use the default
+
+// unless told otherwise, the packed blocks may use up to this fraction of the cache's
+// budget. What they use is taken from what the unpacked blocks may use.
+#define DEFAULT_PACKED_DIVISOR 3
+
+// worst case: every section raw, with its header byte, and the rest no smaller
+// for PackBits, which adds a header byte for every 128 literal bytes
+#define BLOCK_TAIL_OFFSET offsetof(WorldBlock, rendercache)
+#define PACKED_MAX (4 + 2*16 + sizeof(WorldBlock) + (sizeof(WorldBlock) - BLOCK_TAIL_OFFSET)/128 + 1)
+
+// packing is done only on the main thread, so one buffer will do
+static unsigned char gPackBuffer[PACKED_MAX];
+
+static size_t packed_budget() {
+    return gPackedBudgetSet ? min(gPackedBudget, get_budget()) : get_budget() / DEFAULT_PACKED_DIVISOR;
+}
+
+// PackBits: a header byte n of 0..127 is followed by n+1 bytes to copy,
+// one of 129..255 by a byte to repeat 257-n times
+static size_t rle_pack(const unsigned char *src, size_t len, unsigned char *dst) {
+    size_t in = 0, out = 0, run, start;
+
+    while (in < len) {
+        for (run = 1; in + run < len && run < 128 && src[in + run] == src[in]; run++)
+            ;
+        if (run > 1) {
+            dst[out++] = (unsigned char)(257 - run);
+            dst[out++] = src[in];
+            in += run;
+        } else {
+            // copy bytes up to the next run of three or more
+            start = in;
+            do {
+                in++;
+            } while (in < len && in - start < 128 &&
+                !(in + 2 < len && src[in] == src[in + 1] && src[in] == src[in + 2]));
+            dst[out++] = (unsigned char)(in - start - 1);
+            memcpy(dst + out, src + start, in - start);
+            out += in - start;
+        }
+    }
+    return out;
+}
+
+// returns 1 if src unpacked to exactly len bytes
+static int rle_unpack(const unsigned char *src, size_t srcLen, unsigned char *dst, size_t len) {
+    size_t in = 0, out = 0, n;
+
+    while (in < srcLen) {
+        unsigned char header = src[in++];
+        if (header < 128) {
+            n = (size_t)header + 1;
+            if (in + n > srcLen || out + n > len)
+                return 0;
+            memcpy(dst + out, src + in, n);
+            in += n;
+        } else if (header > 128) {
+            n = 257 - (size_t)header;
+            if (in >= srcLen || out + n > len)
+                return 0;
+            memset(dst + out, src[in++], n);
+        } else {
+            continue;   // 128 is a no-op
+        }
+        out += n;
+    }
+    return out == len;
+}
+
+/* A packed block keeps only the sections with something in them. Each is a palette
+ * of the block types, ID and data value, it uses - most sections use just a handful -
+ * and a small index into it for each voxel. Light is kept the same way, and the rest
+ * of the block, its last render and such, run-length encoded:
+ *   2 bytes: mask of sections with blocks; 2 bytes: mask of sections with light
+ *   for each section with blocks, then each with light:
+ *     1 byte: bits per index, 0, 1, 2, 4 or 8; or SECTION_RAW
+ *     if raw: the section's bytes, as they are in the block
+ *     else: 2 bytes: palette size; 2 bytes for each entry; then the indices for the
+ *       section's voxels, packed into bytes from the lowest bits up
+ *   PackBits of the block after light
+ */
+#define SECTION_RAW 0xff
+#define SECTION_VOXELS (16*16*16)
+#define PALETTE_MAX 256
+
+// a voxel's palette entry, for blocks: its ID and data value
+#define BLOCK_KEY(id,dataVal) (((id)<<4)|(dataVal))
+
+// where each key is in the palette being built, or -1
+static short gPaletteSlot[BLOCK_KEY(255,15)+1];
+static int gPaletteSlotReady=0;
+
+static unsigned short gSectionKeys[SECTION_VOXELS];
+
+// pack the keys for a section, or if that saves nothing, its raw bytes.
+// returns the bytes written to dst
+static size_t pack_section(const unsigned short *keys, unsigned char *dst,
+    const unsigned char *raw, size_t rawLen, const unsigned char *raw2, size_t raw2Len) {
+    unsigned short palette[PALETTE_MAX];
+    unsigned char *out = dst;
+    int n = 0, i, k, bits, perByte;
+
+    if (!gPaletteSlotReady) {
+        memset(gPaletteSlot, 0xff, sizeof(gPaletteSlot));
+        gPaletteSlotReady = 1;
+    }
+    for (i = 0; i < SECTION_VOXELS; i++) {
+        if (gPaletteSlot[keys[i]] < 0) {
+            if (n == PALETTE_MAX)
+                break;
+            gPaletteSlot[keys[i]] = (short)n;
+            palette[n++] = keys[i];
+        }
+    }
+    bits = (n <= 1) ? 0 : (n <= 2) ? 1 : (n <= 4) ? 2 : (n <= 16) ? 4 : 8;
+
+    if (i < SECTION_VOXELS || 3 + 2*(size_t)n + SECTION_VOXELS*bits/8 >= rawLen + raw2Len) {
+        *out++ = SECTION_RAW;
+        memcpy(out, raw, rawLen);
+        out += rawLen;
+        if (raw2 != NULL) {     // light has no second array
+            memcpy(out, raw2, raw2Len);
+            out += raw2Len;
+        }
+    } else {
+        *out++ = (unsigned char)bits;
+        *out++ = (unsigned char)(n & 0xff);
+        *out++ = (unsigned char)(n >> 8);
+        for (k = 0; k < n; k++) {
+            *out++ = (unsigned char)(palette[k] & 0xff);
+            *out++ = (unsigned char)(palette[k] >> 8);
+        }
+        if (bits > 0) {
+            perByte = 8 / bits;
+            for (i = 0; i < SECTION_VOXELS; i += perByte) {
+                unsigned int b = 0;
+                for (k = 0; k < perByte; k++)
+                    b |= (unsigned int)gPaletteSlot[keys[i + k]] << (k*bits);
+                *out++ = (unsigned char)b;
+            }
+        }
+    }
+
+    for (k = 0; k < n; k++)
+        gPaletteSlot[palette[k]] = -1;
+    return out - dst;
+}
+
+// unpack a section's keys, or if it was kept raw, copy its bytes to raw and raw2.
+// returns the bytes read from src, 0 if they don't make sense
+static size_t unpack_section(const unsigned char *src, size_t len, unsigned short *keys, int *isRaw,
+    unsigned char *raw, size_t rawLen, unsigned char *raw2, size_t raw2Len) {
+    unsigned short palette[PALETTE_MAX];
+    const unsigned char *in = src, *end = src + len;
+    int n, i, k, bits, perByte, mask;
+
+    if (in >= end)
+        return 0;
+    bits = *in++;
+    *isRaw = (bits == SECTION_RAW);
+    if (*isRaw) {
+        if ((size_t)(end - in) < rawLen + raw2Len)
+            return 0;
+        memcpy(raw, in, rawLen);
+        if (raw2 != NULL)
+            memcpy(raw2, in + rawLen, raw2Len);
+        return 1 + rawLen + raw2Len;
+    }
+
+    if (end - in < 2)
+        return 0;
+    n = in[0] | (in[1] << 8);
+    in += 2;
+    if (n < 1 || n > PALETTE_MAX || (bits != 0 && bits != 1 && bits != 2 && bits != 4 && bits != 8) ||
+        end - in < 2*n + SECTION_VOXELS*bits/8)
+        return 0;
+    for (k = 0; k < n; k++, in += 2)
+        palette[k] = (unsigned short)(in[0] | (in[1] << 8));
+
+    if (bits == 0) {
+        for (i = 0; i < SECTION_VOXELS; i++)
+            keys[i] = palette[0];
+    } else {
+        perByte = 8 / bits;
+        mask = (1 << bits) - 1;
+        for (i = 0; i < SECTION_VOXELS; i += perByte, in++) {
+            for (k = 0; k < perByte; k++) {
+                int slot = (*in >> (k*bits)) & mask;
+                if (slot >= n)
+                    return 0;
+                keys[i + k] = palette[slot];
+            }
+        }
+    }
+    return in - src;
+}
+
+static int section_empty(const unsigned char *p, size_t len) {
+    size_t i;
+    for (i = 0; i < len; i++)
+        if (p[i])
+            return 0;
+    return 1;
+}
+
+// returns the bytes written to dst, at most PACKED_MAX
+static size_t pack_block(WorldBlock *block, unsigned char *dst) {
+    unsigned char *out = dst + 4;
+    unsigned int blockMask = 0, lightMask = 0;
+    int s, i;
+
+    for (s = 0; s < 16; s++) {
+        unsigned char *grid = block->grid + s*SECTION_VOXELS;
+        unsigned char *data = block->data + s*SECTION_VOXELS/2;
+        if (section_empty(grid, SECTION_VOXELS) && section_empty(data, SECTION_VOXELS/2))
+            continue;
+        blockMask |= 1 << s;
+        for (i = 0; i < SECTION_VOXELS; i += 2) {
+            gSectionKeys[i] = (unsigned short)BLOCK_KEY(grid[i], data[i/2] & 0xf);
+            gSectionKeys[i+1] = (unsigned short)BLOCK_KEY(grid[i+1], data[i/2] >> 4);
+        }
+        out += pack_section(gSectionKeys, out, grid, SECTION_VOXELS, data, SECTION_VOXELS/2);
+    }
+    for (s = 0; s < 16; s++) {
+        unsigned char *light = block->light + s*SECTION_VOXELS/2;
+        if (section_empty(light, SECTION_VOXELS/2))
+            continue;
+        lightMask |= 1 << s;
+        for (i = 0; i < SECTION_VOXELS; i += 2) {
+            gSectionKeys[i] = light[i/2] & 0xf;
+            gSectionKeys[i+1] = light[i/2] >> 4;
+        }
+        out += pack_section(gSectionKeys, out, light, SECTION_VOXELS/2, NULL, 0);
+    }
+    dst[0] = (unsigned char)(blockMask & 0xff);
+    dst[1] = (unsigned char)(blockMask >> 8);
+    dst[2] = (unsigned char)(lightMask & 0xff);
+    dst[3] = (unsigned char)(lightMask >> 8);
+
+    out += rle_pack((unsigned char *)block + BLOCK_TAIL_OFFSET, sizeof(WorldBlock) - BLOCK_TAIL_OFFSET, out);
+    return out - dst;
+}
+
+// returns 1 if src held a whole packed block
+static int unpack_block(const unsigned char *src, size_t len, WorldBlock *block) {
+    const unsigned char *in = src + 4, *end = src + len;
+    unsigned int blockMask, lightMask;
+    size_t used;
+    int s, i, isRaw;
+
+    if (len < 4)
+        return 0;
+    blockMask = src[0] | (src[1] << 8);
+    lightMask = src[2] | (src[3] << 8);
+    memset(block->grid, 0, sizeof(block->grid));
+    memset(block->data, 0, sizeof(block->data));
+    memset(block->light, 0, sizeof(block->light));
+
+    for (s = 0; s < 16; s++) {
+        unsigned char *grid = block->grid + s*SECTION_VOXELS;
+        unsigned char *data = block->data + s*SECTION_VOXELS/2;
+        if (!(blockMask & (1 << s)))
+            continue;
+        used = unpack_section(in, end - in, gSectionKeys, &isRaw, grid, SECTION_VOXELS, data, SECTION_VOXELS/2);
+        if (used == 0)
+            return 0;
+        in += used;
+        if (isRaw)
+            continue;
+        for (i = 0; i < SECTION_VOXELS; i += 2) {
+            grid[i] = (unsigned char)(gSectionKeys[i] >> 4);
+            grid[i+1] = (unsigned char)(gSectionKeys[i+1] >> 4);
+            data[i/2] = (unsigned char)((gSectionKeys[i] & 0xf) | ((gSectionKeys[i+1] & 0xf) << 4));
+        }
+    }
+    for (s = 0; s < 16; s++) {
+        unsigned char *light = block->light + s*SECTION_VOXELS/2;
+        if (!(lightMask & (1 << s)))
+            continue;
+        used = unpack_section(in, end - in, gSectionKeys, &isRaw, light, SECTION_VOXELS/2, NULL, 0);
+        if (used == 0)
+            return 0;
+        in += used;
+        if (isRaw)
+            continue;
+        for (i = 0; i < SECTION_VOXELS; i += 2)
+            light[i/2] = (unsigned char)((gSectionKeys[i] & 0xf) | ((gSectionKeys[i+1] & 0xf) << 4));
+    }
+
+    return rle_unpack(in, end - in, (unsigned char *)block + BLOCK_TAIL_OFFSET, sizeof(WorldBlock) - BLOCK_TAIL_OFFSET);
+}
+
+static void packed_unlink(packed_entry *entry) {
+    packed_entry **cur;
+
+    for (cur = &gPackedCache[hash_coord(entry->x, entry->z)]; *cur != entry; cur = &((**cur).next))
+        ;
+    *cur = entry->next;
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+    else
+        gPackedNewest = entry->older;
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else
+        gPackedOldest = entry->newer;
+    gPackedBytes -= entry->bytes;
+}
+
+static packed_entry *packed_find(int x, int z) {
+    packed_entry *entry;
+
+    if (gPackedCache == NULL)
+        return NULL;
+    for (entry = gPackedCache[hash_coord(x, z)]; entry != NULL; entry = entry->next)
+        if (entry->x == x && entry->z == z)
+            return entry;
+    return NULL;
+}
+
+static void packed_drop(int x, int z) {
+    packed_entry *entry = packed_find(x, z);
+    if (entry != NULL) {
+        packed_unlink(entry);
+        free(entry);
+    }
+}
+
+// drop the oldest packed block
+static void packed_evict() {
+    packed_entry *oldest = gPackedOldest;
+    packed_unlink(oldest);
+    free(oldest);
+}
+
+// keep a copy of a block that is leaving the cache, if there's room
+static void packed_add(int x, int z, WorldBlock *block) {
+    packed_entry *entry;
+    size_t length, bytes, budget;
+    int hash;
+
+    budget = packed_budget();
+    if (budget == 0)
+        return;
+
+    length = pack_block(block, gPackBuffer);
+    bytes = sizeof(packed_entry) + length;
+    if (bytes > budget)
+        return;
+
+    if (gPackedCache == NULL) {
+        gPackedCache = (packed_entry**)malloc(sizeof(packed_entry*) * HASH_SIZE);
+        if (gPackedCache == NULL)
+            return;
+        memset(gPackedCache, 0, sizeof(packed_entry*) * HASH_SIZE);
+    }
+    packed_drop(x, z);
+    while (gPackedBytes + bytes > budget)
+        packed_evict();
+
+    entry = (packed_entry*)malloc(bytes);
+    if (entry == NULL)
+        return;
+    entry->x = x;
+    entry->z = z;
+    entry->bytes = bytes;
+    entry->length = length;
+    memcpy(entry + 1, gPackBuffer, length);
+
+    hash = hash_coord(x, z);
+    entry->next = gPackedCache[hash];
+    gPackedCache[hash] = entry;
+    entry->newer = NULL;
+    entry->older = gPackedNewest;
+    if (gPackedNewest != NULL)
+        gPackedNewest->newer = entry;
+    else
+        gPackedOldest = entry;
+    gPackedNewest = entry;
+    gPackedBytes += bytes;
+}
+
+static void packed_trim() {
+    size_t budget = packed_budget();
+
+    while (gPackedBytes > budget)
+        packed_evict();
+}
+
+static void packed_empty() {
+    while (gPackedOldest != NULL)
+        packed_evict();
+    free(gPackedCache);
+    gPackedCache = NULL;
+}
+
+// the oldest entry on a list that isn't held
+static block_entry* oldest_unheld(int which) {
+    block_entry *entry;
+
+    for (entry = gLists[which].oldest; entry != NULL && entry->held == gHoldGeneration; entry = entry->newer)
+        ;
+    return entry;
+}
+
+// take the least valuable entry out of the cache, packing and freeing its block but not the entry
+static block_entry* cache_evict() {
+    block_entry *victim, **cur;
+
+    victim = oldest_unheld(PROBATION);
+    if (victim == NULL)
+        victim = oldest_unheld(PROTECTED);
+    if (victim == NULL)
+        return NULL;
+
+    list_unlink(victim);
+    for (cur = &gBlockCache[hash_coord(victim->x, victim->z)]; *cur != victim; cur = &((**cur).next))
+        ;
+    *cur = victim->next;
+    gCacheBytes -= victim->bytes;
+    packed_add(victim->x, victim->z, victim->data);
+    block_free(victim->data);
+    return victim;
+}
+
+// Evict blocks until another bytes' worth fits in the budget along with the packed
+// blocks, which give way only once no unpacked ones are left. Returns the last entry
+// evicted, for reuse, or NULL if none were.
+static block_entry* make_room(size_t bytes) {
+    block_entry *spare = NULL, *evicted;
+    size_t budget = get_budget();
+
+    while (gCacheBytes > 0 && gCacheBytes + gPackedBytes + bytes > budget) {
+        evicted = cache_evict();
+        if (evicted == NULL)
+            break;
+        if (spare != NULL)
+            pool_free(&gEntryPool, spare);
+        spare = evicted;
+    }
+    while (gPackedOldest != NULL && gCacheBytes + gPackedBytes + bytes > budget)
+        packed_evict();
+    return spare;
+}
+
+#ifdef __linux__
+// the memory limit of our cgroup, or 0 if there is none
+static unsigned long long cgroup_limit() {
+    static const char *files[] = {
+        "/sys/fs/cgroup/memory.max",                    // cgroup v2
+        "/sys/fs/cgroup/memory/memory.limit_in_bytes"   // cgroup v1
+    };
+    unsigned long long limit = 0;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(files)/sizeof(files[0]) && limit == 0; i++) {
+        FILE *f = fopen(files[i], "r");
+        if (f == NULL)
+            continue;
+        // v2 says "max" when unlimited, which fails to scan and leaves 0
+        if (fscanf(f, "%llu", &limit) != 1)
+            limit = 0;
+        fclose(f);
+    }
+    return limit;
+}
+#endif
+
+// how much memory the cache may use if not told otherwise
+static size_t default_budget() {
+    unsigned long long physical = 0;
+    size_t budget;
+#ifdef WIN32
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    if (GlobalMemoryStatusEx(&status))
+        physical = status.ullTotalPhys;
+#elif defined(__linux__)
+    struct sysinfo info;
+    unsigned long long limit;
+    if (sysinfo(&info) == 0)
+        physical = (unsigned long long)info.totalram * info.mem_unit;
+    // in a container, the limit may be much lower than the machine's memory.
+    // v1 reports a huge number when there's no limit, which this also handles
+    limit = cgroup_limit();
+    if (limit > 0 && limit < physical)
+        physical = limit;
+#endif
+    if (physical == 0)
+        return (size_t)INITIAL_CACHE_SIZE * sizeof(WorldBlock);
+
+    physical /= DEFAULT_BUDGET_DIVISOR;
+    if (sizeof(void*) == 4 && physical > MAX_BUDGET_32BIT)
+        physical = MAX_BUDGET_32BIT;
+    budget = (size_t)physical;
+    return max(budget, MIN_BUDGET_BLOCKS * sizeof(WorldBlock));
+}
+
+static size_t memory_budget() {
+    if (gMemoryBudget == 0)
+        gMemoryBudget = default_budget();
+    return gMemoryBudget;
+}
+
+static size_t get_budget() {
+    if (gCacheBudget == 0)
+        gCacheBudget = memory_budget();
+    return max(gCacheBudget, min(gCacheFloor, memory_budget()));
+}
+
+// evict blocks until the cache fits its budget
+static void fit_budget() {
+    block_entry *spare;
+
+    packed_trim();
+    spare = make_room(0);
+    if (spare != NULL)
+        pool_free(&gEntryPool, spare);
+    trim_protected();
+}
+
+// Set how much memory the cached blocks, unpacked and packed, may take up, in bytes;
+// 0 goes back to the default, worked out from the memory there is. If the cache holds
+// more than that, blocks are evicted until it fits.
+void Cache_SetBudget( size_t bytes )
+{
+    gCacheBudget = (bytes == 0) ? memory_budget() : bytes;
+    fit_budget();
+}
+
+size_t Cache_GetBudget()
+{
+    return get_budget();
+}
+
+size_t Cache_GetBytes()
+{
+    return gCacheBytes;
+}
+
+// Set how much of the cache's budget the packed copies of blocks pushed out of it may
+// take up; 0 turns them off. Until this is called, they may have a third of it.
+void Cache_SetPackedBudget( size_t bytes )
+{
+    gPackedBudget = bytes;
+    gPackedBudgetSet = 1;
+    packed_trim();
+}
+
+size_t Cache_GetPackedBytes()
+{
+    return gPackedBytes;
+}
+
+// Ask for room for at least size blocks, as the map window needs, larger or smaller
+// than before. It's only a floor under the budget: it never takes the cache past the
+// default budget, what the memory there is allows, nor lowers a budget set above it.
+// If the budget shrinks, blocks are evicted until the cache fits.
 void Change_Cache_Size( int size )
 {
-    if ( size == gHashMaxEntries )
-    {
-        // no change - why did you call?
-        return;
+    gCacheFloor = (size_t)min((unsigned long long)max(size, 0) * sizeof(WorldBlock), (unsigned long long)memory_budget());
+    fit_budget();
+}
+
+// CACHE_POLICY_LRU or CACHE_POLICY_2Q; cached blocks are kept
+void Cache_SetPolicy( int policy )
+{
+    block_entry *entry;
+
+    gCachePolicy = policy;
+    if (policy == CACHE_POLICY_LRU) {
+        // one list for everything. Blocks on probation were used longest ago.
+        while ((entry = gLists[PROBATION].newest) != NULL) {
+            list_unlink(entry);
+            list_append(PROTECTED, entry);
+        }
+    } else {
+        trim_protected();
     }
-    // mindless, but safe: empty cache and just start again.
-    Cache_Empty();
-    gHashMaxEntries = size;
 }
 
 void Cache_Add(int bx, int bz, void *data)
 {
     int hash;
-    block_entry *to_del=NULL;
+    block_entry *entry, *to_del=NULL;
 
     if (gBlockCache == NULL) {
         gBlockCache = (block_entry**)malloc(sizeof(block_entry*) * HASH_SIZE);
         memset(gBlockCache, 0, sizeof(block_entry*) * HASH_SIZE);
-        gCacheHistory = (IPoint2*)malloc(sizeof(IPoint2) * gHashMaxEntries);
-        gCacheN = 0;
+        memset(gLists, 0, sizeof(gLists));
+        gCacheBytes = 0;
     }
 
     hash = hash_coord(bx, bz);
 
-    if (gCacheN >= gHashMaxEntries) {
-        // we need to remove an old entry
-        IPoint2 coord = gCacheHistory[gCacheN % gHashMaxEntries];
-        int oldhash = hash_coord(coord.x, coord.z);
-
-        block_entry **cur = &gBlockCache[oldhash];
-        while (*cur != NULL) {
-            if ((**cur).x == coord.x && (**cur).z == coord.z) {
-                to_del = *cur;
-                *cur = to_del->next;
-                block_free(to_del->data);
-                //free(to_del); // we will re-use this entry
-                break;
-            }
-            cur = &((**cur).next);
+    // a packed copy would be stale once this block changes
+    packed_drop(bx, bz);
+
+    // a block read again, with more in it, replaces the one cached
+    for (entry = gBlockCache[hash]; entry != NULL; entry = entry->next)
+        if (entry->x == bx && entry->z == bz)
+        {
+            if (entry->data != data)
+                block_free(entry->data);
+            entry->data = (WorldBlock*)data;
+            cache_touch(entry);
+            return;
         }
-    }
+
+    // remove old entries until there's room; we will re-use one of them
+    to_del = make_room(sizeof(WorldBlock));
 
     if (to_del != NULL) {
         // re-use the old entry for the new one
@@ -121,28 +1033,86 @@ void Cache_Add(int bx, int bz, void *data)
         to_del->x = bx;
         to_del->z = bz;
         to_del->data = (WorldBlock*)data;
+        to_del->held = 0;
         gBlockCache[hash] = to_del;
     } else {
-        gBlockCache[hash] = hash_new(bx, bz, data, gBlockCache[hash]);
+        entry = hash_new(bx, bz, data, gBlockCache[hash]);
+        if (entry == NULL) {
+            // out of memory; the block simply isn't kept
+            block_free((WorldBlock*)data);
+            return;
+        }
+        gBlockCache[hash] = entry;
     }
 
-    gCacheHistory[gCacheN % gHashMaxEntries].x = bx;
-    gCacheHistory[gCacheN % gHashMaxEntries].z = bz;
-    gCacheN++;
+    // with 2Q, a block has to be used again before it is protected
+    gBlockCache[hash]->bytes = sizeof(WorldBlock);
+    list_push((gCachePolicy == CACHE_POLICY_LRU) ? PROTECTED : PROBATION, gBlockCache[hash]);
+    gCacheBytes += sizeof(WorldBlock);
 }
 
 void *Cache_Find(int bx,int bz)
 {
 	block_entry *entry;
+	WorldBlock *block;
 
-	if (gBlockCache == NULL)
+	entry = hash_find(bx, bz);
+	if (entry != NULL)
+	{
+		cache_touch(entry);
+		return entry->data;
+	}
+
+	// bring a packed copy back into the cache
+	if (packed_find(bx, bz) == NULL)
+		return NULL;
+	block = block_alloc();
+	if (block == NULL)
 		return NULL;
+	if (!Cache_Unpack(bx, bz, block))
+	{
+		block_free(block);
+		return NULL;
+	}
+	Cache_Add(bx, bz, block);
+	return block;
+}
+
+void *Cache_Peek(int bx,int bz)
+{
+	block_entry *entry = hash_find(bx, bz);
+
+	return (entry != NULL) ? entry->data : NULL;
+}
+
+// Cache_Find, and keep the block from being evicted until Cache_ReleaseHeld
+void *Cache_Hold(int bx,int bz)
+{
+	WorldBlock *block = (WorldBlock *)Cache_Find(bx, bz);
+
+	if (block != NULL)
+		hash_find(bx, bz)->held = gHoldGeneration;
+	return block;
+}
+
+void Cache_ReleaseHeld()
+{
+	// entries start out with 0, which is never a generation
+	if (++gHoldGeneration == 0)
+		gHoldGeneration = 1;
+}
 
-	for (entry = gBlockCache[hash_coord(bx, bz)]; entry != NULL; entry = entry->next)
-		if (entry->x == bx && entry->z == bz)
-			return entry->data;
+int Cache_Unpack(int bx,int bz,WorldBlock *block)
+{
+	packed_entry *entry = packed_find(bx, bz);
+	int ok;
 
-	return NULL;
+	if (entry == NULL)
+		return 0;
+	ok = unpack_block((unsigned char *)(entry + 1), entry->length, block);
+	packed_unlink(entry);
+	free(entry);
+	return ok;
 }
 
 void Cache_Empty()
@@ -150,53 +1120,72 @@ void Cache_Empty()
     int hash;
     block_entry *entry,*next;
 
+    packed_empty();
     if (gBlockCache == NULL)
         return;
 
-    for (hash = 0; hash < HASH_SIZE; hash++) {
-        entry = gBlockCache[hash];
-        while (entry != NULL) {
-            next = entry->next;
-            free(entry->data);
-            free(entry);
-            entry = next;
+    // if no blocks are in use outside the cache, all the slabs can simply be dropped
+    if (!block_pool_reset(gEntryPool.used)) {
+        for (hash = 0; hash < HASH_SIZE; hash++) {
+            entry = gBlockCache[hash];
+            while (entry != NULL) {
+                next = entry->next;
+                block_free(entry->data);
+                entry = next;
+            }
         }
     }
-    
+    pool_reset(&gEntryPool);
+
     free(gBlockCache);
-    free(gCacheHistory);
     gBlockCache = NULL;
+    memset(gLists, 0, sizeof(gLists));
+    gCacheBytes = 0;
 }
 
-/* a simple malloc wrapper, based on the observation that a common
- * behavior pattern for Mineways when the cache is at max capacity
- * is something like:
- *
- * newBlock = malloc(sizeof(Block));
- * cacheAdd(newBlock)
- *  free(oldBlock) // same size
- *
- * Repeatedly. Recycling the old block can prevent the need for 
- * malloc and free.
- */
+// blocks are allocated and freed by chunk decoding threads, too
+static PORTALOCK gBlockLock;
+static int gBlockLockReady = (PortaLockInit(&gBlockLock), 1);
 
-static WorldBlock* last_block = NULL;
+// a block slab is several large pages, and rounding it up just leaves room for more blocks
+static pool gBlockPool = { SLOT_SIZE(sizeof(WorldBlock)), BLOCKS_PER_SLAB, 1 };
 
 WorldBlock* block_alloc() 
 {
-    if (last_block != NULL)
-    {
-        WorldBlock* ret = last_block;
-        last_block = NULL;
-        return ret;
-    }
-    return (WorldBlock*)malloc(sizeof(WorldBlock));
+    WorldBlock* ret;
+    PortaLock(&gBlockLock);
+    ret = (WorldBlock*)pool_alloc(&gBlockPool);
+    PortaUnlock(&gBlockLock);
+    return ret;
 }
 
 void block_free(WorldBlock* block)
 {
-    if (last_block != NULL)
-        free(last_block);
-    
-    last_block = block;
+    if (block == NULL)
+        return;
+    PortaLock(&gBlockLock);
+    pool_free(&gBlockPool, block);
+    PortaUnlock(&gBlockLock);
+}
+
+// Drop all the block slabs at once, if the only blocks in use are the cache's.
+// returns 1 if it did, 0 if some blocks are held elsewhere
+static int block_pool_reset(int cachedBlocks)
+{
+    int reset;
+    PortaLock(&gBlockLock);
+    reset = (gBlockPool.used == cachedBlocks);
+    if (reset)
+        pool_reset(&gBlockPool);
+    PortaUnlock(&gBlockLock);
+    return reset;
+}
+
+void block_pool_stats(size_t *bytes, int *used, int *capacity)
+{
+    PortaLock(&gBlockLock);
+    *bytes = gBlockPool.bytes + gEntryPool.bytes;
+    *used = gBlockPool.used;
+    *capacity = gBlockPool.capacity;
+    PortaUnlock(&gBlockLock);
 }
@@ -30,8 +30,28 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef __CACHE_H__
 #define __CACHE_H__
 
+#include <stddef.h>
+
+// number of blocks the map starts out asking the cache to hold
 #define INITIAL_CACHE_SIZE 6000
 
+// what to read from a chunk into a WorldBlock
+#define DECODE_BLOCKS 0x01  // grid and data: they go together, as some IDs depend on data
+#define DECODE_LIGHT 0x02   // light
+#define DECODE_ALL (DECODE_BLOCKS|DECODE_LIGHT)
+
+typedef struct DecodeRequest {
+    int channels;       // DECODE_* flags
+    int minSection;     // the 16-block-high sections to read, 0 to 15;
+    int maxSection;     // the rest are left empty
+} DecodeRequest;
+
+// does the block hold everything the request asks for?
+#define BLOCK_HAS(block,request) ( \
+    ((block)->decoded.channels & (request)->channels) == (request)->channels && \
+    (block)->decoded.minSection <= (request)->minSection && \
+    (block)->decoded.maxSection >= (request)->maxSection )
+
 typedef struct WorldBlock {
 	unsigned char grid[16*16*256];  // blockid array [y+(z+x*16)*256]
 	// someday we'll need the top four bits field when > 256 blocks
@@ -41,6 +61,10 @@ typedef struct WorldBlock {
 
     unsigned char rendercache[16*16*4]; // bitmap of last render
     unsigned char heightmap[16*16]; // height of rendered block [x+z*16]
+    short top[16*16];   // height of the highest non-air block, -1 for none [x+z*16]
+    unsigned short columnMask[16*16];   // bit n set if the column has a non-air block in y 16n through 16n+15 [x+z*16]
+    unsigned short sectionMask; // bit n set if y 16n through 16n+15 has anything but plain air
+    unsigned int columnBits[16*16][8]; // bit y&31 of word y>>5 set if the column has a block the map shows at y [x+z*16]
 
     int rendery;        // slice height for last render
     int renderopts;     // options bitmask for last render
@@ -49,26 +73,49 @@ typedef struct WorldBlock {
                         // when it was last rendered (for blocks on the
                         // left edge of the map, this might be +1)
     unsigned short colormap; //color map when this was rendered
+
+    DecodeRequest decoded;  // what was read into grid, data and light
 } WorldBlock;
 
-void Change_Cache_Size( int size );
+// replacement policies for the cache
+#define CACHE_POLICY_LRU 0  // least recently used goes first
+#define CACHE_POLICY_2Q 1   // blocks used only once go first, so a sweep over many
+                            // chunks, as for an export, doesn't push out the map view
+
+// The cache is not thread safe: only the main thread should call these.
+// The budget covers both the cached blocks and the packed ones pushed out of it;
+// the packed ones may have up to Cache_SetPackedBudget's share of it.
+void Change_Cache_Size( int size );     // the least the budget may be, in blocks, up or down
+void Cache_SetBudget( size_t bytes );
+size_t Cache_GetBudget();
+size_t Cache_GetBytes();
+void Cache_SetPackedBudget( size_t bytes );
+size_t Cache_GetPackedBytes();
+void Cache_SetPolicy( int policy );
+// Blocks pushed out of the cache are kept packed for a while. Cache_Find counts as a
+// use, and brings a packed block back, which may push out others.
 void *Cache_Find(int bx,int bz);
-void Cache_Add(int bx,int bz,void *data);
+// Cache_Peek only looks: it skips packed blocks and does not count as a use, so the
+// block stays as likely to be evicted as before. Like any block from the cache, it
+// may be freed by the next Cache_Add or Cache_Find.
+void *Cache_Peek(int bx,int bz);
+// Cache_Hold is Cache_Find, and also keeps the block from being evicted until
+// Cache_ReleaseHeld, so it can still be peeked at after adding others.
+void *Cache_Hold(int bx,int bz);
+void Cache_ReleaseHeld();
+// unpack a packed block into the given one, which the caller then owns; 1 if it was there
+int Cache_Unpack(int bx,int bz,WorldBlock *block);
+void Cache_Add(int bx,int bz,void *data);   // replaces, and frees, any block cached for bx,bz
 void Cache_Empty();
 
-/* a simple malloc wrapper, based on the observation that a common
- * behavior pattern for Mineways when the cache is at max capacity
- * is something like:
- *
- * newBlock = malloc(sizeof(Block));
- * cacheAdd(newBlock)
- *  free(oldBlock) // same size
- *
- * Repeated over and over. Recycling the most recently freed block
- * prevents expensive reallocations.
+/* Blocks come from a pool of large slabs, rather than each being malloc'ed:
+ * the map and exports go through thousands of them, all the same size.
  */
 
+// these two can be called from any thread
 WorldBlock* block_alloc();           // allocate memory for a block
 void block_free(WorldBlock* block); // release memory for a block
+// memory held by the block and cache entry pools, blocks handed out, and blocks that fit
+void block_pool_stats(size_t *bytes, int *used, int *capacity);
 
 #endif
@@ -70,6 +70,7 @@ bfFile newNBT(const wchar_t *filename)
     }
 
     ret.gz = gzdopen(_fileno(fptr),"rb");
+    ret.length = 0;
     ret._offset = 0;
     ret.offset = &ret._offset;
     return ret;
@@ -275,7 +276,337 @@ static int nbtFindElement(bfFile bf,char *name)
     }
 }
 
-int nbtGetBlocks(bfFile bf, unsigned char *buff, unsigned char *data, unsigned char *blockLight)
+/* Scanning an NBT chunk for nbtGetBlocks, either held in memory or inflated bit by
+ * bit as it is read. Names are compared in place, arrays are inflated straight to
+ * where they go when possible, and nothing after the Sections list is inflated at
+ * all. Every read is checked against the end of the data; any error stops the scan.
+ */
+
+#define SCAN_WINDOW 16384       // bytes inflated at a time for reading tags and skipping
+#define SCAN_NAME_MAX 64        // longer names are skipped unread; none we look for is
+#define SCAN_INFLATE_MAX (1024 * 2048)  // 2MB limit for inflated chunks
+
+#define SECTION_ARRAYS 3        // Blocks, Data, BlockLight
+static const int gSectionArraySize[SECTION_ARRAYS] = {16*16*16, 16*16*8, 16*16*8};
+
+typedef struct {
+    const unsigned char *p;     // next byte to read
+    const unsigned char *end;   // end of the bytes at hand
+    z_stream *strm;             // where more come from, or NULL if that's all
+    unsigned char window[SCAN_WINDOW];
+    // a section's arrays, when they come before its Y tag
+    unsigned char staging[SECTION_ARRAYS][16*16*16];
+} nbtScanner;
+
+#define SCAN_LEFT(s) ((s)->end - (s)->p)
+
+// compare a tag name of len bytes at name to a string constant
+#define NAME_IS(name,len,str) ((len) == sizeof(str)-1 && memcmp((name),(str),sizeof(str)-1) == 0)
+
+static int scanSkipType(nbtScanner *s, int type);
+
+// inflate up to len more bytes of the chunk into dest.
+// returns how many, 0 at the end of the chunk or on error
+static int scanInflate(nbtScanner *s, unsigned char *dest, int len)
+{
+    int status;
+
+    s->strm->next_out = dest;
+    s->strm->avail_out = len;
+    status = inflate(s->strm, Z_NO_FLUSH);
+    if (status != Z_OK && status != Z_STREAM_END)
+        return 0;
+    if (s->strm->total_out > SCAN_INFLATE_MAX)
+        return 0;
+    return len - (int)s->strm->avail_out;
+}
+
+// make at least n bytes, no more than SCAN_NAME_MAX, available at s->p
+static int scanFill(nbtScanner *s, int n)
+{
+    int have = (int)SCAN_LEFT(s);
+    unsigned char *end;
+
+    if (have >= n)
+        return 1;
+    if (s->strm == NULL)
+        return 0;
+    memmove(s->window, s->p, have);
+    end = s->window + have;
+    while (end - s->window < n)
+    {
+        int got = scanInflate(s, end, SCAN_WINDOW - (int)(end - s->window));
+        if (got == 0)
+            return 0;
+        end += got;
+    }
+    s->p = s->window;
+    s->end = end;
+    return 1;
+}
+
+static int scanByte(nbtScanner *s, unsigned char *b)
+{
+    if (!scanFill(s, 1))
+        return 0;
+    *b = *s->p++;
+    return 1;
+}
+
+static int scanWord(nbtScanner *s, int *w)
+{
+    if (!scanFill(s, 2))
+        return 0;
+    *w = (s->p[0]<<8)|s->p[1];
+    s->p += 2;
+    return 1;
+}
+
+static int scanDword(nbtScanner *s, int *d)
+{
+    if (!scanFill(s, 4))
+        return 0;
+    *d = (int)(((unsigned int)s->p[0]<<24)|(s->p[1]<<16)|(s->p[2]<<8)|s->p[3]);
+    s->p += 4;
+    return 1;
+}
+
+static int scanSkip(nbtScanner *s, long long len)
+{
+    if (len < 0)
+        return 0;
+    while (len > SCAN_LEFT(s))
+    {
+        len -= SCAN_LEFT(s);
+        s->p = s->end;
+        if (!scanFill(s, 1))
+            return 0;
+    }
+    s->p += len;
+    return 1;
+}
+
+// read len bytes into dest, which holds destLen; any more are skipped
+static int scanArray(nbtScanner *s, unsigned char *dest, int len, int destLen)
+{
+    int n, have;
+
+    if (len < 0)
+        return 0;
+    n = min(len, destLen);
+
+    // use up what's at hand, then inflate the rest straight into dest
+    have = min(n, (int)SCAN_LEFT(s));
+    memcpy(dest, s->p, have);
+    s->p += have;
+    dest += have;
+    n -= have;
+    while (n > 0)
+    {
+        int got;
+        if (s->strm == NULL || (got = scanInflate(s, dest, n)) == 0)
+            return 0;
+        dest += got;
+        n -= got;
+    }
+    return scanSkip(s, len - min(len, destLen));
+}
+
+// read a tag's type and name. The name is not terminated, and only good until the
+// next read; it is NULL for names too long to be one we're looking for.
+static int scanTag(nbtScanner *s, unsigned char *type, const unsigned char **name, int *len)
+{
+    if (!scanByte(s, type))
+        return 0;
+    if (*type == 0)
+        return 1;
+    if (!scanWord(s, len))
+        return 0;
+    if (*len > SCAN_NAME_MAX)
+    {
+        *name = NULL;
+        return scanSkip(s, *len);
+    }
+    if (!scanFill(s, *len))
+        return 0;
+    *name = s->p;
+    s->p += *len;
+    return 1;
+}
+
+// skip the payloads of len items of the given type
+static int scanSkipItems(nbtScanner *s, int type, int len)
+{
+    static const int sizes[] = {0, 1, 2, 4, 8, 4, 8};
+    int i, n;
+
+    if (len < 0)
+        return 0;
+    if (type >= 1 && type <= 6)
+        return scanSkip(s, (long long)len * sizes[type]);
+    for (i = 0; i < len; i++)
+    {
+        switch (type)
+        {
+            case 7: //byte array
+                if (!scanDword(s, &n) || !scanSkip(s, n))
+                    return 0;
+                break;
+            case 11: //int array
+                if (!scanDword(s, &n) || !scanSkip(s, (long long)n * 4))
+                    return 0;
+                break;
+            default:
+                if (!scanSkipType(s, type))
+                    return 0;
+                break;
+        }
+    }
+    return 1;
+}
+
+static int scanSkipType(nbtScanner *s, int type)
+{
+    unsigned char subType;
+    const unsigned char *name;
+    int len;
+
+    switch (type)
+    {
+        case 8: //string
+            return scanWord(s, &len) && scanSkip(s, len);
+        case 9: //list
+            return scanByte(s, &subType) && scanDword(s, &len) && scanSkipItems(s, subType, len);
+        case 10: //compound
+            for (;;)
+            {
+                if (!scanTag(s, &subType, &name, &len))
+                    return 0;
+                if (subType == 0)
+                    return 1;
+                if (!scanSkipType(s, subType))
+                    return 0;
+            }
+        default:
+            return scanSkipItems(s, type, 1);
+    }
+}
+
+// like nbtFindElement: move past the tags in a compound up to the one wanted
+static int scanFindElement(nbtScanner *s, const char *wanted, int wantedLen)
+{
+    unsigned char type;
+    const unsigned char *name;
+    int len;
+
+    for (;;)
+    {
+        if (!scanTag(s, &type, &name, &len) || type == 0)
+            return 0;
+        if (len == wantedLen && memcmp(name, wanted, len) == 0)
+            return type;
+        if (!scanSkipType(s, type))
+            return 0;
+    }
+}
+
+static int scanBlocks(nbtScanner *s, unsigned char *buff, unsigned char *data, unsigned char *blockLight, const DecodeRequest *request)
+{
+    unsigned char *arrays[SECTION_ARRAYS];
+    unsigned char type;
+    const unsigned char *name;
+    int len, nsections, i;
+    int wantBlocks = request->channels & DECODE_BLOCKS;
+    int wantLight = request->channels & DECODE_LIGHT;
+
+    arrays[0] = buff;
+    arrays[1] = data;
+    arrays[2] = blockLight;
+
+    //Level/Sections
+    if (!scanTag(s, &type, &name, &len) || type != 10)
+        return 0;
+    if (scanFindElement(s, "Level", 5) != 10)
+        return 0;
+    if (scanFindElement(s, "Sections", 8) != 9)
+        return 0;
+    if (!scanByte(s, &type) || type != 10 || !scanDword(s, &nsections))
+        return 0;
+
+    memset(buff, 0, 16*16*256);
+    memset(data, 0, 16*16*128);
+    memset(blockLight, 0, 16*16*128);
+
+    while (nsections-- > 0)
+    {
+        int staged[SECTION_ARRAYS] = {0, 0, 0};    // bytes held for each array
+        int y = -1;
+
+        for (;;)
+        {
+            int which = -1;
+
+            if (!scanTag(s, &type, &name, &len))
+                return 0;
+            if (type == 0)
+                break;
+            if (type == 1 && NAME_IS(name, len, "Y"))
+            {
+                unsigned char b;
+                if (!scanByte(s, &b))
+                    return 0;
+                y = b;
+                continue;
+            }
+            if (type == 7)
+            {
+                if (wantBlocks && NAME_IS(name, len, "Blocks"))
+                    which = 0;
+                else if (wantBlocks && NAME_IS(name, len, "Data"))
+                    which = 1;
+                else if (wantLight && NAME_IS(name, len, "BlockLight"))
+                    which = 2;
+            }
+            if (which < 0)
+            {
+                if (!scanSkipType(s, type))
+                    return 0;
+            }
+            else if (!scanDword(s, &len))
+            {
+                return 0;
+            }
+            else if (y < 0)
+            {
+                // which section this is isn't known yet; hold on to the array
+                staged[which] = min(max(len, 0), gSectionArraySize[which]);
+                if (!scanArray(s, s->staging[which], len, gSectionArraySize[which]))
+                    return 0;
+            }
+            else if (y >= request->minSection && y <= request->maxSection)
+            {
+                if (!scanArray(s, arrays[which] + gSectionArraySize[which]*y, len, gSectionArraySize[which]))
+                    return 0;
+            }
+            else if (!scanSkip(s, len))
+            {
+                return 0;
+            }
+        }
+
+        if (y < 0)
+            return 0;   // which section is this?
+        if (y < request->minSection || y > request->maxSection)
+            continue;   // not wanted, or above the top of the world
+        for (i = 0; i < SECTION_ARRAYS; i++)
+            memcpy(arrays[i] + gSectionArraySize[i]*y, s->staging[i], staged[i]);
+    }
+    // anything after the sections, such as entities, is left unread
+    return 1;
+}
+
+// request: which arrays and sections to fill in; the rest are left zeroed
+int nbtGetBlocks(bfFile bf, unsigned char *buff, unsigned char *data, unsigned char *blockLight, const DecodeRequest *request)
 {
 	int len,nsections;
 	//int found;
@@ -284,6 +615,23 @@ int nbtGetBlocks(bfFile bf, unsigned char *buff, unsigned char *data, unsigned c
     char *thisName;
 #endif
 
+    if (bf.type == BF_BUFFER || bf.type == BF_INFLATE)
+    {
+        nbtScanner scan;
+        if (bf.type == BF_BUFFER)
+        {
+            scan.p = bf.buf + *bf.offset;
+            scan.end = bf.buf + bf.length;
+            scan.strm = NULL;
+        }
+        else
+        {
+            scan.p = scan.end = scan.window;
+            scan.strm = bf.strm;
+        }
+        return scanBlocks(&scan, buff, data, blockLight, request);
+    }
+
     //Level/Blocks
     bfseek(bf,1,SEEK_CUR); //skip type
     len=readWord(bf); //name length
@@ -315,6 +663,11 @@ int nbtGetBlocks(bfFile bf, unsigned char *buff, unsigned char *data, unsigned c
 		return 0;
 	    bfread(bf,&y,1);
 	    bfseek(bf,save,SEEK_SET); //rewind to start of section
+	    if (y < request->minSection || y > request->maxSection)
+	    {
+		skipCompound(bf);
+		continue;
+	    }
 
 	    //found=0;
 	    for (;;)
@@ -332,21 +685,21 @@ int nbtGetBlocks(bfFile bf, unsigned char *buff, unsigned char *data, unsigned c
 #endif
 		bfread(bf,thisName,len);
 		thisName[len]=0;
-		if (strcmp(thisName,"BlockLight")==0)
+		if ((request->channels & DECODE_LIGHT) && strcmp(thisName,"BlockLight")==0)
 		{
 			//found++;
 			ret=1;
 			len=readDword(bf); //array length
 			bfread(bf,blockLight+16*16*8*y,len);
 		}
-		if (strcmp(thisName,"Blocks")==0)
+		if ((request->channels & DECODE_BLOCKS) && strcmp(thisName,"Blocks")==0)
 		{
 			//found++;
 			ret=1;
 			len=readDword(bf); //array length
 			bfread(bf,buff+16*16*16*y,len);
 		}
-        else if (strcmp(thisName,"Data")==0)
+        else if ((request->channels & DECODE_BLOCKS) && strcmp(thisName,"Data")==0)
         {
             //found++;
             ret=1;
@@ -33,19 +33,22 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #include "zlib.h"
 #include <stdio.h>
 
-enum {BF_BUFFER, BF_GZIP};
+enum {BF_BUFFER, BF_GZIP, BF_INFLATE};
 
 // wraps gzFile and memory buffers with a consistent interface
 typedef struct {
     int type;
     unsigned char *buf;
+    int length;         // bytes in buf, for BF_BUFFER
     int *offset;
     int _offset;
     gzFile gz;
+    z_stream *strm;     // a zlib stream set up to inflate NBT data, for BF_INFLATE;
+                        // only nbtGetBlocks reads these
 } bfFile;
 
 bfFile newNBT(const wchar_t *filename);
-int nbtGetBlocks(bfFile bf, unsigned char *buff, unsigned char *data, unsigned char *blockLight);
+int nbtGetBlocks(bfFile bf, unsigned char *buff, unsigned char *data, unsigned char *blockLight, const DecodeRequest *request);
 void nbtGetSpawn(bfFile bf,int *x,int *y,int *z);
 void nbtGetFileVersion(bfFile bf, int *version);
 void nbtGetPlayer(bfFile bf,int *px,int *py,int *pz);
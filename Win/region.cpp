@@ -62,107 +62,612 @@ deflated data is the chunk length - 1.
 
 #include "stdafx.h"
 
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
 #define CHUNK_DEFLATE_MAX (1024 * 1024)  // 1MB limit for compressed chunks
-#define CHUNK_INFLATE_MAX (1024 * 2048) // 2MB limit for inflated chunks
 
-#define RERROR(x) if(x) { PortaClose(regionFile); return 0; }
+// how many region files we keep open at once. A screenful of map at zoom 1
+// touches at most a handful of regions; an export sweep touches a column of them.
+#define REGION_POOL_SIZE 32
 
+// when reading chunks in bulk, chunks separated by at most this many unneeded
+// sectors are read together, rather than seeking past the gap
+#define REGION_RUN_GAP 8
 
-// directory: the base world directory, e.g. "/home/ryan/.minecraft/saves/World1/" - note the trailing "/" is in place
-// cx, cz: the chunk's x and z offset
-// block: a 32KB buffer to write block data into
-// blockLight: a 16KB buffer to write block light into (not skylight)
-//
-// returns 1 on success, 0 on error
-int regionGetBlocks(wchar_t *directory, int cx, int cz, unsigned char *block, unsigned char *data, unsigned char *blockLight) 
-{
-    wchar_t filename[256];
+// an open region file, along with the chunk locations from its header. The
+// timestamps in the header's second half aren't kept: nothing reads them.
+typedef struct RegionFile {
+    wchar_t directory[256];
+    int rx, rz;
     PORTAFILE regionFile;
+    unsigned int location[1024];    // sector offset << 8 | sector count, per chunk
+    unsigned int lastUsed;          // for least-recently-used replacement
+    int users;                      // threads currently reading from this file
+    int pooled;                     // 0 for a one-off, closed when released
+} RegionFile;
+
+// everything needed to decode a chunk. Each thread decoding chunks needs its own.
+struct ChunkDecoder {
+    unsigned char *buf;     // compressed chunk, as read from the region file
+    z_stream strm;          // inflates it as the NBT is scanned
+};
+
+static RegionFile *gRegionPool[REGION_POOL_SIZE];
+static int gRegionPoolN = 0;
+static unsigned int gRegionClock = 0;
+
+// the pool is shared by all decoding threads
+static PORTALOCK gRegionLock;
+static int gRegionLockReady = (PortaLockInit(&gRegionLock), 1);
+
+// used when no decoder is passed in, i.e. by the main thread
+static ChunkDecoder *gDefaultDecoder = NULL;
+
+// Which region files and chunks exist. Unlike the pool this is never trimmed, so that
+// asking again for chunks that aren't there costs no I/O, even once their region file
+// has been closed. Kept for one directory at a time, and protected by gRegionLock.
+#define PRESENCE_HASH_SIZE 256
+
+typedef struct RegionPresence {
+    int rx, rz;
+    int exists;                 // 0 if the region file is missing or unreadable
+    unsigned int present[32];   // bit per chunk, set if the header has a location for it
+    struct RegionPresence *next;
+} RegionPresence;
+
+static RegionPresence *gPresence[PRESENCE_HASH_SIZE];
+static wchar_t gPresenceDirectory[256];
+
+#define PRESENCE_HASH(rx,rz) (((rx)*31 + (rz)) & (PRESENCE_HASH_SIZE-1))
+
+
+// read len bytes starting at byte offset ofs, with a single call (no separate seek).
+// Safe to call from several threads on the same file.
+// returns the number of bytes read, or -1 on error
+static int readAt(PORTAFILE regionFile, unsigned int ofs, unsigned char *buf, int len)
+{
 #ifdef WIN32
     DWORD br;
+    OVERLAPPED ov;
+    memset(&ov,0,sizeof(OVERLAPPED));
+    ov.Offset = ofs;
+    if (!ReadFile(regionFile,buf,len,&br,&ov))
+        return -1;
+    return (int)br;
+#else
+    return (int)pread(fileno(regionFile),buf,len,ofs);
 #endif
-	static unsigned char *buf=NULL,*out=NULL;
-
-    int sectorNumber, offset, chunkLength;
-    
-    int status;
-	bfFile bf;
-	
-    static z_stream strm;
-    static int strm_initialized = 0;
+}
 
-	if (buf==NULL)
-	{
-		// note that these will never get freed, but we just need this one.
-		buf=(unsigned char*)malloc(CHUNK_DEFLATE_MAX);
-		out=(unsigned char*)malloc(CHUNK_INFLATE_MAX);
-	}
+// open a region file and read its header; returns NULL if it doesn't exist or is broken
+static RegionFile *openRegionFile(wchar_t *directory, int rx, int rz)
+{
+    wchar_t filename[256];
+    unsigned char header[4096];
+    RegionFile *rf;
+    PORTAFILE regionFile;
+    int i;
 
     // open the region file - note we get the new mca 1.2 file type here!
-    swprintf_s(filename,256,L"%sregion/r.%d.%d.mca",directory,cx>>5,cz>>5);
+    swprintf_s(filename,256,L"%sregion/r.%d.%d.mca",directory,rx,rz);
 
     regionFile=PortaOpen(filename);
     if (regionFile == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    // read the chunk locations in one shot
+    rf = (RegionFile *)malloc(sizeof(RegionFile));
+    if (rf == NULL || readAt(regionFile,0,header,4096) != 4096)
+    {
+        free(rf);
+        PortaClose(regionFile);
+        return NULL;
+    }
+
+    wcsncpy_s(rf->directory,256,directory,255);
+    rf->rx = rx;
+    rf->rz = rz;
+    rf->regionFile = regionFile;
+    for (i = 0; i < 1024; i++)
+        rf->location[i] = (header[i*4]<<24)|(header[i*4+1]<<16)|(header[i*4+2]<<8)|header[i*4+3];
+    rf->users = 0;
+    rf->pooled = 0;
+    return rf;
+}
+
+static void clearPresence()
+{
+    RegionPresence *rp, *next;
+    int i;
+
+    for (i = 0; i < PRESENCE_HASH_SIZE; i++)
+    {
+        for (rp = gPresence[i]; rp != NULL; rp = next)
+        {
+            next = rp->next;
+            free(rp);
+        }
+        gPresence[i] = NULL;
+    }
+    gPresenceDirectory[0] = 0;
+}
+
+// what's known about region rx,rz, or NULL if it has never been opened.
+// Call with gRegionLock held.
+static RegionPresence *findPresence(wchar_t *directory, int rx, int rz)
+{
+    RegionPresence *rp;
+
+    if (wcscmp(gPresenceDirectory,directory) != 0)
+        return NULL;
+    for (rp = gPresence[PRESENCE_HASH(rx,rz)]; rp != NULL; rp = rp->next)
+        if (rp->rx == rx && rp->rz == rz)
+            return rp;
+    return NULL;
+}
+
+// note which chunks region rx,rz has, from its header; rf is NULL if it couldn't be opened.
+// Call with gRegionLock held.
+static void recordPresence(wchar_t *directory, int rx, int rz, RegionFile *rf)
+{
+    RegionPresence *rp;
+    int i;
+
+    if (wcscmp(gPresenceDirectory,directory) != 0)
+    {
+        // a different world or dimension; forget the old one
+        clearPresence();
+        wcsncpy_s(gPresenceDirectory,256,directory,255);
+    }
+    if (findPresence(directory, rx, rz) != NULL)
+        return;
+
+    rp = (RegionPresence *)malloc(sizeof(RegionPresence));
+    if (rp == NULL)
+        return;
+    rp->rx = rx;
+    rp->rz = rz;
+    rp->exists = (rf != NULL);
+    memset(rp->present, 0, sizeof(rp->present));
+    if (rf != NULL)
+    {
+        for (i = 0; i < 1024; i++)
+            if ((rf->location[i] >> 8) != 0 && (rf->location[i] & 0xff) != 0)
+                rp->present[i>>5] |= 1u << (i&31);
+    }
+    rp->next = gPresence[PRESENCE_HASH(rx,rz)];
+    gPresence[PRESENCE_HASH(rx,rz)] = rp;
+}
+
+// Find the region file holding chunk cx,cz in the pool, opening it and reading
+// its header if it's not already there. Returns NULL if the region file doesn't exist
+// or its header can't be read. Call regionRelease when done reading from it.
+static RegionFile *regionOpen(wchar_t *directory, int cx, int cz)
+{
+    RegionFile *rf;
+    RegionPresence *rp;
+    int i, rx, rz, oldest;
+
+    rx = cx>>5;
+    rz = cz>>5;
+
+    PortaLock(&gRegionLock);
+    for (i = 0; i < gRegionPoolN; i++)
+    {
+        rf = gRegionPool[i];
+        if (rf->rx == rx && rf->rz == rz && wcscmp(rf->directory,directory) == 0)
+        {
+            rf->lastUsed = ++gRegionClock;
+            rf->users++;
+            PortaUnlock(&gRegionLock);
+            return rf;
+        }
+    }
+
+    // known to be missing? Then don't go looking for it again
+    rp = findPresence(directory, rx, rz);
+    if (rp != NULL && !rp->exists)
+    {
+        PortaUnlock(&gRegionLock);
+        return NULL;
+    }
+
+    rf = openRegionFile(directory, rx, rz);
+    recordPresence(directory, rx, rz, rf);
+    if (rf != NULL)
+    {
+        rf->users = 1;
+        rf->lastUsed = ++gRegionClock;
+
+        // room in the pool? If not, close the least recently used region file
+        // that no thread is reading from. If they're all busy, this file stays
+        // out of the pool and is closed when released.
+        if (gRegionPoolN < REGION_POOL_SIZE)
+        {
+            rf->pooled = 1;
+            gRegionPool[gRegionPoolN++] = rf;
+        }
+        else
+        {
+            oldest = -1;
+            for (i = 0; i < gRegionPoolN; i++)
+                if (gRegionPool[i]->users == 0 && (oldest < 0 || gRegionPool[i]->lastUsed < gRegionPool[oldest]->lastUsed))
+                    oldest = i;
+            if (oldest >= 0)
+            {
+                PortaClose(gRegionPool[oldest]->regionFile);
+                free(gRegionPool[oldest]);
+                rf->pooled = 1;
+                gRegionPool[oldest] = rf;
+            }
+        }
+    }
+    PortaUnlock(&gRegionLock);
+    return rf;
+}
+
+static void regionRelease(RegionFile *rf)
+{
+    PortaLock(&gRegionLock);
+    rf->users--;
+    if (!rf->pooled && rf->users == 0)
+    {
+        PortaClose(rf->regionFile);
+        free(rf);
+    }
+    PortaUnlock(&gRegionLock);
+}
+
+// Close all open region files and forget their headers and which chunks exist. Call
+// this when changing worlds, or to pick up chunks Minecraft has written since the
+// region was opened. No other thread may be reading chunks at the time.
+void regionCloseAll()
+{
+    int i;
+    PortaLock(&gRegionLock);
+    for (i = 0; i < gRegionPoolN; i++)
+    {
+        PortaClose(gRegionPool[i]->regionFile);
+        free(gRegionPool[i]);
+    }
+    gRegionPoolN = 0;
+    clearPresence();
+    PortaUnlock(&gRegionLock);
+}
+
+// Does chunk cx,cz exist? Answered from memory if its region has been looked at
+// before, otherwise by reading the region's header. Safe to call from any thread.
+//
+// returns 1 if the region file has the chunk, 0 if not
+int regionChunkExists(wchar_t *directory, int cx, int cz)
+{
+    RegionPresence *rp;
+    RegionFile *rf;
+    int i, exists;
+
+    i = (cx&31)+(cz&31)*32;
+
+    PortaLock(&gRegionLock);
+    rp = findPresence(directory, cx>>5, cz>>5);
+    if (rp != NULL)
+    {
+        exists = rp->exists && (rp->present[i>>5] & (1u << (i&31))) != 0;
+        PortaUnlock(&gRegionLock);
+        return exists;
+    }
+    PortaUnlock(&gRegionLock);
+
+    // never seen this region: opening it records what it has
+    rf = regionOpen(directory, cx, cz);
+    if (rf == NULL)
+        return 0;
+    exists = (rf->location[i] >> 8) != 0 && (rf->location[i] & 0xff) != 0;
+    regionRelease(rf);
+    return exists;
+}
+
+// allocate the buffers and inflate stream for decoding chunks.
+// returns NULL if out of memory
+ChunkDecoder *newChunkDecoder()
+{
+    ChunkDecoder *decoder = (ChunkDecoder *)malloc(sizeof(ChunkDecoder));
+    if (decoder == NULL)
+        return NULL;
+    decoder->buf = (unsigned char*)malloc(CHUNK_DEFLATE_MAX);
+    // we re-use dynamically allocated memory
+    decoder->strm.zalloc = (alloc_func)NULL;
+    decoder->strm.zfree = (free_func)NULL;
+    decoder->strm.opaque = NULL;
+    decoder->strm.next_in = NULL;
+    decoder->strm.avail_in = 0;
+    if (decoder->buf == NULL || inflateInit(&decoder->strm) != Z_OK)
+    {
+        free(decoder->buf);
+        free(decoder);
+        return NULL;
+    }
+    return decoder;
+}
+
+void freeChunkDecoder(ChunkDecoder *decoder)
+{
+    if (decoder == NULL)
+        return;
+    inflateEnd(&decoder->strm);
+    free(decoder->buf);
+    free(decoder);
+}
+
+static ChunkDecoder *getDecoder(ChunkDecoder *decoder)
+{
+    if (decoder != NULL)
+        return decoder;
+    if (gDefaultDecoder == NULL)
+    {
+        // note that this will never get freed, but we just need this one.
+        gDefaultDecoder = newChunkDecoder();
+    }
+    return gDefaultDecoder;
+}
+
+// the part of a region file holding one chunk
+typedef struct ChunkSectors {
+    int cx, cz;
+    int offset;     // first 4KB sector
+    int count;      // number of sectors
+} ChunkSectors;
+
+// sort coordinates so that chunks in the same region file are adjacent
+static int regionCompare(const void *a, const void *b)
+{
+    const ChunkCoord *ca = (const ChunkCoord *)a;
+    const ChunkCoord *cb = (const ChunkCoord *)b;
+    if ((ca->cx>>5) != (cb->cx>>5))
+        return (ca->cx>>5) - (cb->cx>>5);
+    return (ca->cz>>5) - (cb->cz>>5);
+}
+// sort chunks by where they are in the region file
+static int sectorCompare(const void *a, const void *b)
+{
+    return ((const ChunkSectors *)a)->offset - ((const ChunkSectors *)b)->offset;
+}
+
+// Read all the chunks listed in one region file, in the order they are stored on disk.
+// Chunks close to each other are read in a single run; if most of the file is needed,
+// the whole stretch is read in one go. If there isn't the memory for a run, its
+// chunks are read one at a time instead.
+static int readRegionChunks(RegionFile *rf, ChunkCoord *coords, int count, RegionChunksCallback callback, void *userData)
+{
+    ChunkSectors *sectors;
+    RegionChunk *chunks;
+    unsigned char *runBuf;
+    int i, j, n, runStart, runEnd, spanStart, spanEnd, neededSectors, bytesRead, delivered, oneAtATime;
+
+    sectors = (ChunkSectors *)malloc(count*sizeof(ChunkSectors));
+    chunks = (RegionChunk *)malloc(count*sizeof(RegionChunk));
+    if (sectors == NULL || chunks == NULL)
+    {
+        free(sectors);
+        free(chunks);
         return 0;
+    }
 
-    // seek to the chunk offset
-    RERROR(PortaSeek(regionFile, 4*((cx&31)+(cz&31)*32)));
+    // look up each chunk's location in the header, dropping chunks that don't exist
+    n = 0;
+    neededSectors = 0;
+    for (i = 0; i < count; i++)
+    {
+        unsigned int location = rf->location[(coords[i].cx&31)+(coords[i].cz&31)*32];
+        if ((location >> 8) == 0 || (location & 0xff) == 0)
+            continue;
+        if ((int)(location & 0xff) * 4096 > CHUNK_DEFLATE_MAX)
+            continue;
+        sectors[n].cx = coords[i].cx;
+        sectors[n].cz = coords[i].cz;
+        sectors[n].offset = location >> 8;
+        sectors[n].count = location & 0xff;
+        neededSectors += sectors[n].count;
+        n++;
+    }
+    if (n == 0)
+    {
+        free(sectors);
+        free(chunks);
+        return 0;
+    }
 
-    // get the chunk offset
-    RERROR(PortaRead(regionFile,buf, 4));
+    qsort(sectors, n, sizeof(ChunkSectors), sectorCompare);
+
+    spanStart = sectors[0].offset;
+    spanEnd = spanStart;
+    for (i = 0; i < n; i++)
+        spanEnd = max(spanEnd, sectors[i].offset + sectors[i].count);
+
+    delivered = 0;
+    oneAtATime = 0;
+    i = 0;
+    while (i < n)
+    {
+        // gather a run of chunks that are (nearly) contiguous on disk. If we need
+        // at least half of the sectors between the first and last chunk, simply
+        // read everything between them.
+        runStart = sectors[i].offset;
+        runEnd = runStart + sectors[i].count;
+        if (oneAtATime)
+        {
+            j = i + 1;
+        }
+        else if (neededSectors * 2 >= spanEnd - spanStart)
+        {
+            j = n;
+            runEnd = spanEnd;
+        }
+        else
+        {
+            for (j = i + 1; j < n && sectors[j].offset <= runEnd + REGION_RUN_GAP; j++)
+                runEnd = max(runEnd, sectors[j].offset + sectors[j].count);
+        }
+
+        runBuf = (unsigned char *)malloc((runEnd - runStart) * 4096);
+        if (runBuf == NULL && j > i + 1)
+        {
+            // no room for the whole run: read the rest of the chunks one at a time,
+            // rather than dropping them as if they didn't exist
+            oneAtATime = 1;
+            j = i + 1;
+            runEnd = runStart + sectors[i].count;
+            runBuf = (unsigned char *)malloc((runEnd - runStart) * 4096);
+        }
+        if (runBuf != NULL)
+        {
+            bytesRead = readAt(rf->regionFile, 4096*runStart, runBuf, (runEnd - runStart) * 4096);
+            if (bytesRead > 0)
+            {
+                int nchunks = 0;
+                for (; i < j; i++)
+                {
+                    int start = (sectors[i].offset - runStart) * 4096;
+                    if (start + 5 > bytesRead)
+                        continue;
+                    chunks[nchunks].cx = sectors[i].cx;
+                    chunks[nchunks].cz = sectors[i].cz;
+                    chunks[nchunks].buf = runBuf + start;
+                    chunks[nchunks].length = min(sectors[i].count * 4096, bytesRead - start);
+                    nchunks++;
+                }
+                if (nchunks > 0)
+                    callback(chunks, nchunks, userData);
+                delivered += nchunks;
+            }
+            free(runBuf);
+        }
+        i = j;
+    }
 
-    sectorNumber = buf[3]; // how many 4096B sectors the chunk takes up
-    offset = (buf[0]<<16)|(buf[1]<<8)|buf[2]; // 4KB sector the chunk is in
+    free(sectors);
+    free(chunks);
+    return delivered;
+}
 
-    RERROR(offset == 0); // an empty chunk
+// Read a set of chunks in bulk. Chunks are grouped by region file, and each region's
+// chunks are read in on-disk order with as few large reads as possible. The callback is
+// called with each batch of chunk data read; each chunk can then be decoded with
+// regionDecodeChunk. The chunk data is freed after the callback returns.
+// Chunks that do not exist are skipped. The coords array is reordered.
+//
+// returns the number of chunks handed to the callback
+int regionReadChunks(wchar_t *directory, ChunkCoord *coords, int count, RegionChunksCallback callback, void *userData)
+{
+    int i, j, delivered;
+    RegionFile *rf;
+
+    qsort(coords, count, sizeof(ChunkCoord), regionCompare);
+
+    delivered = 0;
+    for (i = 0; i < count; i = j)
+    {
+        for (j = i + 1; j < count && regionCompare(&coords[i], &coords[j]) == 0; j++)
+            ;
+        rf = regionOpen(directory, coords[i].cx, coords[i].cz);
+        if (rf != NULL)
+        {
+            delivered += readRegionChunks(rf, &coords[i], j - i, callback, userData);
+            regionRelease(rf);
+        }
+    }
+    return delivered;
+}
 
-    RERROR(PortaSeek(regionFile, 4096*offset));
+// decoder: the decoding buffers to use, or NULL for the main thread's
+// chunk: compressed chunk data from regionReadChunks, starting at its length field
+// block, data, blockLight, request: as for regionGetBlocks
+//
+// returns 1 on success, 0 on error
+int regionDecodeChunk(ChunkDecoder *decoder, RegionChunk *chunk, unsigned char *block, unsigned char *data, unsigned char *blockLight, const DecodeRequest *request)
+{
+    int chunkLength;
+	bfFile bf;
 
-    RERROR(sectorNumber * 4096 > CHUNK_DEFLATE_MAX);
+    decoder = getDecoder(decoder);
+    if (decoder == NULL)
+        return 0;
 
-    // read chunk in one shot
-    // this is faster than reading the header and data separately
-    RERROR(PortaRead(regionFile,buf, 4096 * sectorNumber));
-    
-    chunkLength = (buf[0]<<24)|(buf[1]<<16)|(buf[2]<<8)|buf[3];
+    if (chunk->length < 5)
+        return 0;
+
+    chunkLength = (chunk->buf[0]<<24)|(chunk->buf[1]<<16)|(chunk->buf[2]<<8)|chunk->buf[3];
 
     // sanity check chunk size
-    RERROR(chunkLength > sectorNumber * 4096 || chunkLength > CHUNK_DEFLATE_MAX);
+    if (chunkLength <= 1 || chunkLength > CHUNK_DEFLATE_MAX || chunkLength + 4 > chunk->length)
+        return 0;
     
     // only handle zlib-compressed chunks (v2)
-    RERROR(buf[4] != 2);
+    if (chunk->buf[4] != 2)
+        return 0;
 
-    PortaClose(regionFile);
+    // the chunk is inflated as it is scanned, straight into the block where it can
+    // be, and only as far as the block data goes
+    inflateReset(&decoder->strm);
+    decoder->strm.avail_in = chunkLength - 1;
+    decoder->strm.next_in = chunk->buf + 5;
 
-    // decompress chunk
-    
+    bf.type = BF_INFLATE;
+    bf.strm = &decoder->strm;
 
-    if (!strm_initialized) {
-        // we re-use dynamically allocated memory
-        strm.zalloc = (alloc_func)NULL;
-        strm.zfree = (free_func)NULL;
-        strm.opaque = NULL;
-        inflateInit(&strm);
-        strm_initialized = 1;
-    }
+    return nbtGetBlocks(bf, block, data, blockLight, request);
+}
+
+// directory: the base world directory, e.g. "/home/ryan/.minecraft/saves/World1/" - note the trailing "/" is in place
+// cx, cz: the chunk's x and z offset
+// block: a 32KB buffer to write block data into
+// blockLight: a 16KB buffer to write block light into (not skylight)
+// request: which of those to fill in, and for which sections; the rest are zeroed
+//
+// returns 1 on success, 0 on error
+int regionGetBlocks(wchar_t *directory, int cx, int cz, unsigned char *block, unsigned char *data, unsigned char *blockLight, const DecodeRequest *request) 
+{
+    return regionGetBlocksR(NULL, directory, cx, cz, block, data, blockLight, request);
+}
 
-    strm.next_out = out;
-    strm.avail_out = CHUNK_INFLATE_MAX;
-    strm.avail_in = chunkLength - 1;
-    strm.next_in = buf + 5;
+// reentrant version of regionGetBlocks: threads can decode chunks at the same
+// time, as long as each uses its own decoder.
+int regionGetBlocksR(ChunkDecoder *decoder, wchar_t *directory, int cx, int cz, unsigned char *block, unsigned char *data, unsigned char *blockLight, const DecodeRequest *request) 
+{
+    RegionFile *rf;
+    RegionChunk chunk;
+
+    unsigned int location;
+    int sectorNumber, offset;
 
-    inflateReset(&strm);
-    status = inflate(&strm, Z_FINISH); // decompress in one step
+    decoder = getDecoder(decoder);
+    if (decoder == NULL)
+        return 0;
 
-    if (status != Z_STREAM_END) // error inflating (not enough space?)
+    rf = regionOpen(directory, cx, cz);
+    if (rf == NULL)
         return 0;
 
-    // the uncompressed chunk data is now in "out", with length strm.avail_out
+    // get the chunk offset from the cached header
+    location = rf->location[(cx&31)+(cz&31)*32];
+
+    sectorNumber = location & 0xff; // how many 4096B sectors the chunk takes up
+    offset = location >> 8; // 4KB sector the chunk is in
+
+    if (offset == 0 || // an empty chunk
+        sectorNumber * 4096 > CHUNK_DEFLATE_MAX)
+    {
+        regionRelease(rf);
+        return 0;
+    }
 
-    bf.type = BF_BUFFER;
-    bf.buf = out;
-    bf._offset = 0;
-    bf.offset = &bf._offset;
+    // read chunk in one shot, straight from its position in the file
+    chunk.cx = cx;
+    chunk.cz = cz;
+    chunk.buf = decoder->buf;
+    chunk.length = readAt(rf->regionFile, 4096*offset, decoder->buf, 4096 * sectorNumber);
+    regionRelease(rf);
 
-    return nbtGetBlocks(bf, block, data, blockLight);
+    return regionDecodeChunk(decoder, &chunk, block, data, blockLight, request);
 }
@@ -29,6 +29,30 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef __REGION_H__
 #define __REGION_H__
 
-int regionGetBlocks(wchar_t *directory, int cx, int cz, unsigned char *block, unsigned char *data, unsigned char *blockLight);
+typedef struct ChunkCoord {
+    int cx, cz;
+} ChunkCoord;
+
+// compressed data for one chunk, as read from its region file
+typedef struct RegionChunk {
+    int cx, cz;
+    unsigned char *buf;     // starts with the chunk's 4-byte length field
+    int length;             // number of bytes available at buf
+} RegionChunk;
+
+typedef void (*RegionChunksCallback)(RegionChunk *chunks, int count, void *userData);
+
+// buffers and inflate stream for decoding chunks; see region.cpp
+typedef struct ChunkDecoder ChunkDecoder;
+
+ChunkDecoder *newChunkDecoder();
+void freeChunkDecoder(ChunkDecoder *decoder);
+
+int regionGetBlocks(wchar_t *directory, int cx, int cz, unsigned char *block, unsigned char *data, unsigned char *blockLight, const DecodeRequest *request);
+int regionGetBlocksR(ChunkDecoder *decoder, wchar_t *directory, int cx, int cz, unsigned char *block, unsigned char *data, unsigned char *blockLight, const DecodeRequest *request);
+int regionReadChunks(wchar_t *directory, ChunkCoord *coords, int count, RegionChunksCallback callback, void *userData);
+int regionDecodeChunk(ChunkDecoder *decoder, RegionChunk *chunk, unsigned char *block, unsigned char *data, unsigned char *blockLight, const DecodeRequest *request);
+int regionChunkExists(wchar_t *directory, int cx, int cz);
+void regionCloseAll();
 
 #endif
@@ -30,10 +30,11 @@ THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "targetver.h"
 #include "cache.h"
+#include "region.h"
+#include "threads.h"
 #include "MinewaysMap.h"
 #include "ObjFileManip.h"
 #include "nbt.h"
-#include "region.h"
 
 #define WIN32_LEAN_AND_MEAN             // Exclude rarely-used stuff from Windows headers
 // Windows Header Files:
@@ -75,6 +76,10 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #define PortaRead(h,buf,len) !ReadFile(h,buf,len,&br,NULL)
 #define PortaWrite(h,buf,len) !WriteFile(h,buf,(DWORD)len,&br,NULL)
 #define PortaClose(h) CloseHandle(h)
+#define PORTALOCK CRITICAL_SECTION
+#define PortaLockInit(l) InitializeCriticalSection(l)
+#define PortaLock(l) EnterCriticalSection(l)
+#define PortaUnlock(l) LeaveCriticalSection(l)
 #endif
 
 #ifndef WIN32
@@ -88,6 +93,11 @@ THE POSSIBILITY OF SUCH DAMAGE.
 #define PortaRead(h,buf,len) fread(buf,len,1,h)!=1
 #define PortaWrite(h,buf,len) fwrite(buf,len,1,h)!=1
 #define PortaClose(h) fclose(h)
+#include <pthread.h>
+#define PORTALOCK pthread_mutex_t
+#define PortaLockInit(l) pthread_mutex_init(l,NULL)
+#define PortaLock(l) pthread_mutex_lock(l)
+#define PortaUnlock(l) pthread_mutex_unlock(l)
 #endif
 
 #if __STDC_VERSION__ >= 199901L
@@ -0,0 +1,2 @@
+// stands in for the Windows SDK header: see windows.h
+#pragma once
@@ -0,0 +1,21 @@
+// Just enough of the Windows headers for the modules under test to build
+// elsewhere; stdafx.h includes these unconditionally.
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+
+typedef unsigned long DWORD;
+typedef unsigned short WORD;
+typedef int BOOL;
+typedef wchar_t WCHAR;
+typedef wchar_t TCHAR;
+typedef void *HANDLE;
+
+// the MSVC runtime's names for these
+#define wcsncpy_s(d,n,s,m) wcsncpy(d,s,m)
+#define wcsncat_s(d,n,s,m) wcsncat(d,s,m)
+#define _wfopen_s(f,n,m) (*(f)=NULL,1)
+#define _fileno fileno
@@ -0,0 +1,32 @@
+// A few checks shared by the tests. Each test is its own program, and includes the
+// module it tests so it can get at its static functions.
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static int gChecks=0;
+static int gFailures=0;
+
+#define CHECK(cond) do { \
+    gChecks++; \
+    if (!(cond)) { \
+        gFailures++; \
+        printf("%s:%d: failed: %s\n",__FILE__,__LINE__,#cond); \
+    } \
+} while (0)
+
+// returns main's exit code
+static int testsDone(const char *name)
+{
+    printf("%s: %d checks, %d failed\n",name,gChecks,gFailures);
+    return gFailures ? 1 : 0;
+}
+
+// the same numbers on every run
+static unsigned int gRandom=12345;
+static unsigned int testRandom()
+{
+    gRandom=gRandom*1103515245+12345;
+    return gRandom>>16;
+}
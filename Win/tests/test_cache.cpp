@@ -0,0 +1,157 @@
+// The packed tier's PackBits and palette packing should give back exactly what
+// went in, whatever the block looks like, and the map's asking for room shouldn't
+// take the budget past what memory allows.
+
+#include "../cache.cpp"
+#include "test.h"
+
+static unsigned char gRaw[8192];
+static unsigned char gPacked[8192*2];
+static unsigned char gUnpacked[8192];
+
+static void checkRle(size_t len)
+{
+    size_t packedLen;
+
+    packedLen=rle_pack(gRaw,len,gPacked);
+    // at worst a header byte for every 128 copied
+    CHECK(packedLen<=len+(len+127)/128);
+    memset(gUnpacked,0xcd,sizeof(gUnpacked));
+    CHECK(rle_unpack(gPacked,packedLen,gUnpacked,len));
+    CHECK(memcmp(gRaw,gUnpacked,len)==0);
+    // one byte short, or expecting one more, isn't a whole block
+    if (packedLen>0)
+    {
+        CHECK(!rle_unpack(gPacked,packedLen-1,gUnpacked,len));
+        CHECK(!rle_unpack(gPacked,packedLen,gUnpacked,len+1));
+    }
+}
+
+static void testRle()
+{
+    size_t i,run;
+
+    checkRle(0);
+
+    memset(gRaw,7,sizeof(gRaw));
+    checkRle(1);
+    checkRle(2);
+    checkRle(128);
+    checkRle(129);
+    checkRle(sizeof(gRaw));
+    CHECK(rle_pack(gRaw,sizeof(gRaw),gPacked)==2*sizeof(gRaw)/128);
+
+    for (i=0;i<sizeof(gRaw);i++)
+        gRaw[i]=(unsigned char)testRandom();
+    checkRle(1);
+    checkRle(127);
+    checkRle(128);
+    checkRle(129);
+    checkRle(sizeof(gRaw));
+
+    // runs of every length up to past the longest one PackBits can hold
+    for (i=0,run=1;i<sizeof(gRaw);run=run%200+1)
+    {
+        unsigned char b=(unsigned char)testRandom();
+        size_t n;
+        for (n=0;n<run && i<sizeof(gRaw);n++)
+            gRaw[i++]=b;
+    }
+    checkRle(sizeof(gRaw));
+
+    // pairs are copied rather than repeated
+    for (i=0;i<sizeof(gRaw);i++)
+        gRaw[i]=(unsigned char)(i/2);
+    checkRle(sizeof(gRaw));
+}
+
+static void checkBlock(WorldBlock *block)
+{
+    static WorldBlock unpacked;
+    size_t len;
+
+    len=pack_block(block,gPackBuffer);
+    CHECK(len<=PACKED_MAX);
+    memset(&unpacked,0xcd,sizeof(unpacked));
+    CHECK(unpack_block(gPackBuffer,len,&unpacked));
+    CHECK(memcmp(block,&unpacked,sizeof(unpacked))==0);
+    CHECK(!unpack_block(gPackBuffer,len-1,&unpacked));
+}
+
+static void testPackBlock()
+{
+    static WorldBlock block;
+    int i,s,n;
+
+    // all air, and a rendercache and such to keep
+    memset(&block,0,sizeof(block));
+    block.rendery=3;
+    checkBlock(&block);
+
+    // bedrock, stone and dirt below, with some wool in a few colors
+    for (i=0;i<16*16*64;i++)
+    {
+        int y=i/256;
+        block.grid[i]=(unsigned char)((y==0) ? 7 : (y<60) ? 1 : 3);
+    }
+    for (i=0;i<40;i++)
+    {
+        int at=16*16*64+testRandom()%(16*16*16);
+        block.grid[at]=35;
+        block.data[at/2]|=(unsigned char)((testRandom()&0xf)<<((at&1)*4));
+    }
+    for (i=0;i<(int)sizeof(block.light);i++)
+        block.light[i]=(unsigned char)((i>=16*16*8*4) ? 0xff : 0);
+    for (i=0;i<(int)sizeof(block.rendercache);i++)
+        block.rendercache[i]=(unsigned char)(i/16);
+    checkBlock(&block);
+
+    // palettes of every size, up to more than a byte can index
+    for (s=0;s<16;s++)
+    {
+        n=(s==15) ? 4096 : 1<<(s%10);
+        for (i=0;i<16*16*16;i++)
+        {
+            int key=testRandom()%n;
+            int at=s*16*16*16+i;
+            block.grid[at]=(unsigned char)(key>>4);
+            block.data[at/2]=(unsigned char)((block.data[at/2]&((at&1) ? 0x0f : 0xf0))|((key&0xf)<<((at&1)*4)));
+            block.light[at/2]=(unsigned char)(testRandom()%(s+1));
+        }
+    }
+    checkBlock(&block);
+
+    // random bytes throughout: all raw
+    for (i=0;i<(int)sizeof(block);i++)
+        ((unsigned char *)&block)[i]=(unsigned char)testRandom();
+    checkBlock(&block);
+}
+
+static void testBudget()
+{
+    size_t memory,small=100*sizeof(WorldBlock);
+
+    Cache_SetBudget(0);
+    memory=Cache_GetBudget();
+    Cache_SetBudget(small);
+    CHECK(Cache_GetBudget()==small);
+
+    // a floor above the budget raises it, but only as far as memory allows
+    Change_Cache_Size(200);
+    CHECK(Cache_GetBudget()==200*sizeof(WorldBlock));
+    Change_Cache_Size(2000000000);
+    CHECK(Cache_GetBudget()==memory);
+    // and a lower one, below the budget set, leaves that
+    Change_Cache_Size(10);
+    CHECK(Cache_GetBudget()==small);
+    Cache_SetBudget(0);
+    CHECK(Cache_GetBudget()==memory);
+}
+
+int main()
+{
+    testRle();
+    testPackBlock();
+    testBudget();
+    return testsDone("cache");
+}
@@ -0,0 +1,213 @@
+// convertBlockIDs' SSE2 search should change exactly what the plain loop would,
+// the draw kernels dropping through columnBits draw what stepping through every
+// voxel did, blit's scale tables put each tile pixel where working it out by zoom
+// did, and a new view is scrolled from the last only when that's all that changed.
+
+#include "../MinewaysMap.cpp"
+#include "test.h"
+
+// the map code reads no chunks here
+ChunkDecoder *newChunkDecoder() { return NULL; }
+void freeChunkDecoder(ChunkDecoder *) {}
+int regionGetBlocksR(ChunkDecoder *, wchar_t *, int, int, unsigned char *, unsigned char *, unsigned char *, const DecodeRequest *) { return 0; }
+int regionReadChunks(wchar_t *, ChunkCoord *, int, RegionChunksCallback, void *) { return 0; }
+int regionDecodeChunk(ChunkDecoder *, RegionChunk *, unsigned char *, unsigned char *, unsigned char *, const DecodeRequest *) { return 0; }
+int regionChunkExists(wchar_t *, int, int) { return 0; }
+void regionCloseAll() {}
+
+static WorldBlock gBlock,gExpected;
+
+static void checkConvert(const DecodeRequest *request)
+{
+    int unknown,expectedUnknown;
+    int start=request->minSection*16*16*16;
+    int end=(request->maxSection+1)*16*16*16;
+
+    memcpy(&gExpected,&gBlock,sizeof(gBlock));
+    expectedUnknown=remapIDs(&gExpected,start,end-start);
+    unknown=convertBlockIDs(&gBlock,request);
+    CHECK(unknown==expectedUnknown);
+    CHECK(memcmp(gBlock.grid,gExpected.grid,sizeof(gBlock.grid))==0);
+}
+
+static void testConvert()
+{
+    static const DecodeRequest requests[]={
+        {DECODE_BLOCKS,0,15},
+        {DECODE_BLOCKS,3,9},
+        {DECODE_BLOCKS,15,15},
+    };
+    int r,i;
+
+    for (r=0;r<(int)(sizeof(requests)/sizeof(requests[0]));r++)
+    {
+        // only known IDs, with wool here and there to remap by its data
+        for (i=0;i<(int)sizeof(gBlock.grid);i++)
+            gBlock.grid[i]=(unsigned char)((testRandom()%50==0) ? BLOCK_WOOL : testRandom()%NUM_BLOCKS_STANDARD);
+        for (i=0;i<(int)sizeof(gBlock.data);i++)
+            gBlock.data[i]=(unsigned char)testRandom();
+        checkConvert(&requests[r]);
+
+        // any ID at all
+        for (i=0;i<(int)sizeof(gBlock.grid);i++)
+            gBlock.grid[i]=(unsigned char)testRandom();
+        checkConvert(&requests[r]);
+
+        // one unknown ID, at the last byte of a 16
+        memset(gBlock.grid,1,sizeof(gBlock.grid));
+        gBlock.grid[requests[r].maxSection*16*16*16+31]=255;
+        checkConvert(&requests[r]);
+    }
+}
+
+// columns of air, blocks the map never shows, and blocks it does, at random
+static void fillColumns(WorldBlock *block)
+{
+    int i,y,top;
+
+    memset(block,0,sizeof(*block));
+    for (i=0;i<16*16;i++)
+    {
+        top=testRandom()%257;
+        for (y=0;y<top;y++)
+            if (testRandom()%3)
+                block->grid[y*256+i]=(unsigned char)(testRandom()%NUM_BLOCKS);
+    }
+    for (i=0;i<(int)sizeof(block->data);i++)
+    {
+        block->data[i]=(unsigned char)testRandom();
+        block->light[i]=(unsigned char)testRandom();
+    }
+}
+
+static void testDrawKernels()
+{
+    static WorldBlock stepped;
+    static const int heights[]={MAP_MAX_HEIGHT,200,64,0};
+    unsigned int filters[2]={MAP_VIEW_FLAGS,MAP_VIEW_FLAGS|MAP_SHOWALL_FLAGS};
+    int hitsFound[4],steppedHits[4];
+    int k,f,h,n;
+
+    if (!gColorsInited)
+        initColors();
+    gBoxMinX=gBoxMinZ=2;
+    gBoxMaxX=gBoxMaxZ=12;
+    gBoxMinY=0;
+    gBoxMaxY=MAP_MAX_HEIGHT;
+
+    for (n=0;n<4;n++)
+    {
+        fillColumns(&gBlock);
+        findOccupancy(&gBlock);
+        // with every height marked, a kernel looks at every voxel
+        memcpy(&stepped,&gBlock,sizeof(gBlock));
+        memset(stepped.columnBits,0xff,sizeof(stepped.columnBits));
+        for (k=0;k<(int)(sizeof(gDrawKernels)/sizeof(gDrawKernels[0]));k++)
+            for (f=0;f<2;f++)
+                for (h=0;h<(int)(sizeof(heights)/sizeof(heights[0]));h++)
+                {
+                    memset(hitsFound,0,sizeof(hitsFound));
+                    memset(steppedHits,0,sizeof(steppedHits));
+                    hitsFound[3]=steppedHits[3]=MAP_MAX_HEIGHT+1;
+                    gDrawKernels[k](&gBlock,NULL,0,0,heights[h],filters[f],hitsFound);
+                    gDrawKernels[k](&stepped,NULL,0,0,heights[h],filters[f],steppedHits);
+                    CHECK(memcmp(gBlock.rendercache,stepped.rendercache,sizeof(gBlock.rendercache))==0);
+                    CHECK(memcmp(gBlock.heightmap,stepped.heightmap,sizeof(gBlock.heightmap))==0);
+                    CHECK(memcmp(hitsFound,steppedHits,sizeof(hitsFound))==0);
+                }
+    }
+}
+
+// blit as it was, working out each pixel's place in the tile from the zoom
+static void floatBlit(const unsigned char *block,unsigned char *bits,int px,int py,double zoom,int w,int h)
+{
+    int x,y;
+    int size=(int)(16*zoom);
+
+    for (y=0;y<size;y++)
+        for (x=0;x<size;x++)
+            if (px+x>=0 && px+x<w && py+y>=0 && py+y<h)
+                memcpy(bits+((py+y)*w+px+x)*4,block+(((int)(y/zoom))<<6)+(((int)(x/zoom))<<2),4);
+}
+
+static void testBlit()
+{
+    static const double zooms[]={0.0625,0.25,0.5,0.75,1.0,1.5,2.0,3.0,3.7,4.0,5.0,8.0,13.3,16.0,40.0};
+    static const int places[][2]={{0,0},{10,20},{-5,-9},{-300,0},{90,85},{99,0},{0,89},{100,90}};
+    static unsigned char tile[16*16*4];
+    static unsigned char bits[100*90*4],expected[100*90*4];
+    BlitScale scale;
+    int z,p,x;
+
+    for (x=0;x<(int)sizeof(tile);x++)
+        tile[x]=(unsigned char)testRandom();
+
+    for (z=0;z<(int)(sizeof(zooms)/sizeof(zooms[0]));z++)
+    {
+        setBlitScale(&scale,zooms[z]);
+        CHECK(scale.size==(int)(16*zooms[z]));
+        for (x=0;x<scale.size;x++)
+            CHECK(scale.src[x]==(int)(x/zooms[z]));
+
+        for (p=0;p<(int)(sizeof(places)/sizeof(places[0]));p++)
+        {
+            memset(bits,0xcd,sizeof(bits));
+            memset(expected,0xcd,sizeof(expected));
+            blit(tile,bits,places[p][0],places[p][1],&scale,100,90);
+            floatBlit(tile,expected,places[p][0],places[p][1],zooms[z],100,90);
+            CHECK(memcmp(bits,expected,sizeof(bits))==0);
+        }
+    }
+}
+
+// draw an empty world; returns how many areas had to be drawn, and the first
+static int drawView(unsigned char *bits,double cx,double zoom,int area[4])
+{
+    int areas[2][4];
+    int hitsFound[3];
+    int count;
+    Options opts;
+
+    memset(&opts,0,sizeof(opts));
+    DrawMap(L"",cx,0.0,255,200,150,zoom,bits,opts,hitsFound,NULL);
+    count=GetMapDrawnAreas(areas);
+    if (count>0)
+        memcpy(area,areas[0],sizeof(areas[0]));
+    return count;
+}
+
+static void testScrollLastView()
+{
+    static unsigned char bits[200*150*4];
+    static const int whole[4]={0,0,200,150};
+    int area[4];
+
+    CHECK(drawView(bits,0.0,1.0,area)==1);
+    CHECK(memcmp(area,whole,sizeof(whole))==0);
+    // the same view again needs nothing drawn, and a pan just the strip it uncovers
+    CHECK(drawView(bits,0.0,1.0,area)==0);
+    CHECK(drawView(bits,8.0,1.0,area)==1);
+    CHECK(memcmp(area,whole,sizeof(whole))!=0);
+
+    // zoomed out a level the tiles are drawn at the same scale, but cover twice the world
+    CHECK(drawView(bits,8.0,0.5,area)==1);
+    CHECK(memcmp(area,whole,sizeof(whole))==0);
+    CHECK(drawView(bits,8.0,0.25,area)==1);
+    CHECK(memcmp(area,whole,sizeof(whole))==0);
+    CHECK(drawView(bits,8.0,0.5,area)==1);
+    CHECK(memcmp(area,whole,sizeof(whole))==0);
+
+    // and anything else about the buffer changing means drawing it all
+    DrawMapCancel();
+    CHECK(drawView(bits,8.0,0.5,area)==1);
+    CHECK(memcmp(area,whole,sizeof(whole))==0);
+}
+
+int main()
+{
+    testConvert();
+    testDrawKernels();
+    testBlit();
+    testScrollLastView();
+    return testsDone("map");
+}
@@ -0,0 +1,207 @@
+// scanBlocks should read just the arrays and sections asked for, whatever order a
+// section's tags come in, and whether the chunk is in memory or still compressed.
+
+#include "../nbt.cpp"
+#include "test.h"
+
+// a chunk as NBT, built up a tag at a time
+static unsigned char gChunk[200000];
+static int gChunkLen;
+
+static void putByte(int b)
+{
+    gChunk[gChunkLen++]=(unsigned char)b;
+}
+
+static void putWord(int w)
+{
+    putByte(w>>8);
+    putByte(w);
+}
+
+static void putDword(int d)
+{
+    putWord(d>>16);
+    putWord(d);
+}
+
+static void putTag(int type,const char *name)
+{
+    putByte(type);
+    putWord((int)strlen(name));
+    memcpy(gChunk+gChunkLen,name,strlen(name));
+    gChunkLen+=(int)strlen(name);
+}
+
+// a section's arrays are filled with bytes made from its Y and the array
+static unsigned char sectionByte(int y,int array,int i)
+{
+    return (unsigned char)(y*16+array*5+i%7+1);
+}
+
+static void putArray(const char *name,int y,int array,int len)
+{
+    int i;
+
+    putTag(7,name);
+    putDword(len);
+    for (i=0;i<len;i++)
+        putByte(sectionByte(y,array,i));
+}
+
+// yFirst: put each section's Y tag before its arrays, else after them
+static void buildChunk(int nsections,int yFirst)
+{
+    int y;
+
+    gChunkLen=0;
+    putTag(10,"");
+    putTag(10,"Level");
+    putTag(3,"xPos");
+    putDword(4);
+    // a list to skip over on the way
+    putTag(9,"Entities");
+    putByte(10);
+    putDword(1);
+    putTag(8,"id");
+    putWord(3);
+    putByte('P'); putByte('i'); putByte('g');
+    putByte(0);
+    putTag(9,"Sections");
+    putByte(10);
+    putDword(nsections);
+    for (y=0;y<nsections;y++)
+    {
+        if (yFirst)
+        {
+            putTag(1,"Y");
+            putByte(y);
+        }
+        putArray("Blocks",y,0,16*16*16);
+        putArray("SkyLight",y,3,16*16*8);
+        putArray("Data",y,1,16*16*8);
+        putArray("BlockLight",y,2,16*16*8);
+        if (!yFirst)
+        {
+            putTag(1,"Y");
+            putByte(y);
+        }
+        putByte(0);
+    }
+    putByte(0);
+    putByte(0);
+}
+
+static unsigned char gBlocks[16*16*256];
+static unsigned char gData[16*16*128];
+static unsigned char gLight[16*16*128];
+
+// did the arrays get just what the request asked for?
+static int arraysMatch(int nsections,const DecodeRequest *request)
+{
+    unsigned char *arrays[3]={gBlocks,gData,gLight};
+    int sizes[3]={16*16*16,16*16*8,16*16*8};
+    int a,y,i;
+
+    for (a=0;a<3;a++)
+    {
+        int wanted=request->channels & ((a==2) ? DECODE_LIGHT : DECODE_BLOCKS);
+        for (y=0;y<16;y++)
+        {
+            int read=wanted && y<nsections && y>=request->minSection && y<=request->maxSection;
+            for (i=0;i<sizes[a];i++)
+                if (arrays[a][y*sizes[a]+i]!=(read ? sectionByte(y,a,i) : 0))
+                    return 0;
+        }
+    }
+    return 1;
+}
+
+static int getBlocks(int compressed,const DecodeRequest *request)
+{
+    static unsigned char deflated[sizeof(gChunk)+1024];
+    uLongf deflatedLen=sizeof(deflated);
+    z_stream strm;
+    bfFile bf;
+    int offset=0;
+    int ret;
+
+    memset(gBlocks,0xcd,sizeof(gBlocks));
+    memset(gData,0xcd,sizeof(gData));
+    memset(gLight,0xcd,sizeof(gLight));
+    memset(&bf,0,sizeof(bf));
+    if (!compressed)
+    {
+        bf.type=BF_BUFFER;
+        bf.buf=gChunk;
+        bf.length=gChunkLen;
+        bf.offset=&offset;
+        return nbtGetBlocks(bf,gBlocks,gData,gLight,request);
+    }
+
+    if (compress(deflated,&deflatedLen,gChunk,gChunkLen)!=Z_OK)
+        return -1;
+    memset(&strm,0,sizeof(strm));
+    if (inflateInit(&strm)!=Z_OK)
+        return -1;
+    strm.next_in=deflated;
+    strm.avail_in=(uInt)deflatedLen;
+    bf.type=BF_INFLATE;
+    bf.strm=&strm;
+    ret=nbtGetBlocks(bf,gBlocks,gData,gLight,request);
+    inflateEnd(&strm);
+    return ret;
+}
+
+static void testSections()
+{
+    static const DecodeRequest requests[]={
+        {DECODE_ALL,0,15},
+        {DECODE_BLOCKS,0,15},
+        {DECODE_LIGHT,0,15},
+        {DECODE_BLOCKS,4,7},
+        {DECODE_ALL,0,0},
+        {DECODE_ALL,15,15},
+    };
+    int r,yFirst,compressed,nsections;
+
+    for (nsections=0;nsections<=16;nsections+=8)
+        for (yFirst=0;yFirst<2;yFirst++)
+        {
+            buildChunk(nsections,yFirst);
+            for (compressed=0;compressed<2;compressed++)
+                for (r=0;r<(int)(sizeof(requests)/sizeof(requests[0]));r++)
+                {
+                    CHECK(getBlocks(compressed,&requests[r])==1);
+                    CHECK(arraysMatch(nsections,&requests[r]));
+                }
+        }
+}
+
+static void testBadChunks()
+{
+    DecodeRequest request={DECODE_ALL,0,15};
+    int len;
+
+    // cut off part way through a section
+    buildChunk(4,1);
+    len=gChunkLen;
+    gChunkLen=len/2;
+    CHECK(getBlocks(0,&request)==0);
+    CHECK(getBlocks(1,&request)==0);
+
+    // a section with no Y: drop its Y tag, which comes last, and the ends after it
+    buildChunk(1,0);
+    gChunkLen-=4+1+3;
+    putByte(0);
+    putByte(0);
+    putByte(0);
+    CHECK(getBlocks(0,&request)==0);
+}
+
+int main()
+{
+    testSections();
+    testBadChunks();
+    return testsDone("nbt");
+}
@@ -0,0 +1,233 @@
+/*
+Copyright (c) 2014, the Mineways contributors
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// threads.cpp - a small pool of worker threads for chunk loading.
+// The threads are started on first use and then sleep between calls.
+
+#include "stdafx.h"
+
+static PORTALOCK gRunLock;
+static int gRunLockReady = (PortaLockInit(&gRunLock), 1);
+
+static int gWorkerCount = 0;
+
+#ifdef WIN32
+#include <process.h>
+
+static HANDLE gStartEvent[MAX_WORKER_THREADS];
+static HANDLE gDoneEvent;
+
+// the current RunParallel() call
+static ParallelJob gJob;
+static void *gJobData;
+static volatile LONG gJobCount;
+static volatile LONG gNextJob;
+static volatile LONG gBusyWorkers;
+
+static void runJobs(int thread)
+{
+    LONG index;
+
+    while ((index = InterlockedIncrement(&gNextJob) - 1) < gJobCount)
+        gJob((int)index, thread, gJobData);
+}
+
+static unsigned __stdcall workerMain(void *arg)
+{
+    int thread = (int)(INT_PTR)arg;
+
+    for (;;)
+    {
+        WaitForSingleObject(gStartEvent[thread], INFINITE);
+        runJobs(thread);
+        if (InterlockedDecrement(&gBusyWorkers) == 0)
+            SetEvent(gDoneEvent);
+    }
+    return 0;
+}
+
+// called with gRunLock held
+static void startWorkers()
+{
+    SYSTEM_INFO si;
+    int i;
+
+    GetSystemInfo(&si);
+    gWorkerCount = clamp((int)si.dwNumberOfProcessors, 1, MAX_WORKER_THREADS);
+
+    gDoneEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    // thread 0 is whoever calls RunParallel()
+    for (i = 1; i < gWorkerCount; i++)
+    {
+        HANDLE thread;
+
+        gStartEvent[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+        thread = (HANDLE)_beginthreadex(NULL, 0, workerMain, (void *)(INT_PTR)i, 0, NULL);
+        if (gStartEvent[i] == NULL || thread == NULL)
+        {
+            // make do with what we have
+            if (gStartEvent[i] != NULL)
+                CloseHandle(gStartEvent[i]);
+            gWorkerCount = i;
+            break;
+        }
+        CloseHandle(thread);
+    }
+    if (gDoneEvent == NULL)
+        gWorkerCount = 1;
+}
+#else
+#include <unistd.h>
+#include <stdint.h>
+
+// the workers wait for the generation to change, then each runs jobs until none are left
+static pthread_mutex_t gPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gStartCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t gDoneCond = PTHREAD_COND_INITIALIZER;
+static unsigned int gGeneration = 0;
+
+// the current RunParallel() call
+static ParallelJob gJob;
+static void *gJobData;
+static int gJobCount;
+static volatile int gNextJob;
+static int gBusyWorkers;
+
+static void runJobs(int thread)
+{
+    int index;
+
+    while ((index = __sync_fetch_and_add(&gNextJob, 1)) < gJobCount)
+        gJob(index, thread, gJobData);
+}
+
+static void *workerMain(void *arg)
+{
+    int thread = (int)(intptr_t)arg;
+    unsigned int seen = 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&gPoolLock);
+        while (gGeneration == seen)
+            pthread_cond_wait(&gStartCond, &gPoolLock);
+        seen = gGeneration;
+        pthread_mutex_unlock(&gPoolLock);
+
+        runJobs(thread);
+
+        pthread_mutex_lock(&gPoolLock);
+        if (--gBusyWorkers == 0)
+            pthread_cond_signal(&gDoneCond);
+        pthread_mutex_unlock(&gPoolLock);
+    }
+    return NULL;
+}
+
+// called with gRunLock held
+static void startWorkers()
+{
+    pthread_t thread;
+    long processors;
+    int i;
+
+    processors = sysconf(_SC_NPROCESSORS_ONLN);
+    gWorkerCount = clamp((int)processors, 1, MAX_WORKER_THREADS);
+
+    // thread 0 is whoever calls RunParallel()
+    for (i = 1; i < gWorkerCount; i++)
+    {
+        if (pthread_create(&thread, NULL, workerMain, (void *)(intptr_t)i) != 0)
+        {
+            // make do with what we have
+            gWorkerCount = i;
+            break;
+        }
+        pthread_detach(thread);
+    }
+}
+#endif
+
+int WorkerCount()
+{
+    if (gWorkerCount == 0)
+    {
+        PortaLock(&gRunLock);
+        if (gWorkerCount == 0)
+            startWorkers();
+        PortaUnlock(&gRunLock);
+    }
+    return gWorkerCount;
+}
+
+void RunParallel(int count, ParallelJob job, void *userData)
+{
+    int i;
+
+    if (count <= 0)
+        return;
+
+    PortaLock(&gRunLock);
+    if (gWorkerCount == 0)
+        startWorkers();
+
+    if (gWorkerCount == 1 || count == 1)
+    {
+        for (i = 0; i < count; i++)
+            job(i, 0, userData);
+        PortaUnlock(&gRunLock);
+        return;
+    }
+
+#ifdef WIN32
+    gJob = job;
+    gJobData = userData;
+    gJobCount = count;
+    gNextJob = 0;
+    gBusyWorkers = gWorkerCount - 1;
+    for (i = 1; i < gWorkerCount; i++)
+        SetEvent(gStartEvent[i]);
+    runJobs(0);
+    WaitForSingleObject(gDoneEvent, INFINITE);
+#else
+    pthread_mutex_lock(&gPoolLock);
+    gJob = job;
+    gJobData = userData;
+    gJobCount = count;
+    gNextJob = 0;
+    gBusyWorkers = gWorkerCount - 1;
+    gGeneration++;
+    pthread_cond_broadcast(&gStartCond);
+    pthread_mutex_unlock(&gPoolLock);
+    runJobs(0);
+    pthread_mutex_lock(&gPoolLock);
+    while (gBusyWorkers > 0)
+        pthread_cond_wait(&gDoneCond, &gPoolLock);
+    pthread_mutex_unlock(&gPoolLock);
+#endif
+    PortaUnlock(&gRunLock);
+}
@@ -0,0 +1,48 @@
+/*
+Copyright (c) 2014, the Mineways contributors
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef __THREADS_H__
+#define __THREADS_H__
+
+// most worker threads ever used, including the calling thread
+#define MAX_WORKER_THREADS 32
+
+// one job of a RunParallel() call. thread is in 0..WorkerCount()-1 and is unique
+// among the jobs running at the same moment, so it can index per-thread scratch data.
+typedef void (*ParallelJob)(int index, int thread, void *userData);
+
+// number of threads RunParallel() spreads work over
+int WorkerCount();
+
+// run job(index) for index 0..count-1 on the worker threads and the calling thread,
+// returning when all are done. Jobs are handed out in index order, but may finish
+// in any order. Calls from different threads are run one after the other; a job
+// must not call RunParallel() itself.
+void RunParallel(int count, ParallelJob job, void *userData);
+
+#endif